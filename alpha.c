@@ -1,21 +1,31 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#define STB_PERLIN_IMPLEMENTATION
 #include "stb_perlin.h"
 #include "raylib/src/raylib.h"
 #include "raylib/src/raymath.h"
 #include "sprite.h"
 #include "physics.h"
+#include "props.h"
+#include "shaders.h"
 
 #define WINDOW_TITLE "Alpha"
 #define CELL_SIZE 0.25f
 #define TREES 30
-
-typedef struct Tile {
-	Vector3 position;
-	Texture2D *texture;
-	Model model;
-} Tile;
+#define PHYSICS_RATE 60
+#define PHYSICS_MAX_SUBSTEPS 4
+#define STATIC_WORLD_CACHE "static_world.cache"
+/* F4 starts and stops recording the physics there, replay it with bench_physics replay */
+#define PHYSICS_RECORDING "physics_recording.bin"
+/* the terrain height is perlin noise sampled every TERRAIN_NOISE_STEP per cell,
+ * it goes from 0 to TERRAIN_HEIGHT */
+#define TERRAIN_NOISE_STEP 0.08f
+#define TERRAIN_HEIGHT 0.4f
+/* the tiles are merged in meshes of TILE_CHUNK_SIZE x TILE_CHUNK_SIZE tiles, drawn with a call each */
+#define TILE_CHUNK_SIZE 16
+/* the tile textures are packed in an atlas of TILE_ATLAS_SIZE x TILE_ATLAS_SIZE textures */
+#define TILE_ATLAS_SIZE 2
 
 typedef struct DebugBody {
 	Vector3 position;
@@ -24,10 +34,19 @@ typedef struct DebugBody {
 	Model drawModel;
 } DebugBody;
 
+/* The tiles of a chunk in a single mesh, 'box' is used to cull the chunk */
+typedef struct TileChunk {
+	Model model;
+	BoundingBox box;
+} TileChunk;
+
+/* TileGrid is drawn as 'chunkCount' models, each one holding the tiles of a chunk */
 typedef struct TileGrid {
 	int rows;
 	int cols;
-	Tile *tiles[];
+	Texture2D atlas;
+	int chunkCount;
+	TileChunk chunks[];
 } TileGrid;
 
 typedef struct Grid {
@@ -42,14 +61,14 @@ typedef struct Entity {
 	Vector3 size;
 	Color color;
 	Model model;
-	RigidBody *body;
+	BodyHandle body;
 } Entity;
 
 typedef struct Entity2D {
 	Vector3 position;
 	Vector2 size;
 	Color color;
-	RigidBody *body;
+	BodyHandle body;
 } Entity2D;
 
 Vector3 zero_pos = (Vector3) { 0, 0, 0 };
@@ -93,52 +112,168 @@ void drawDebugBody(DebugBody *d) {
 	DrawModel(d->drawModel, zero_pos, 1.0f, d->color);
 }
 
-Tile *createTile(Texture2D *texture, float posX, float posY, float posZ) {
-	Tile *tile = malloc(sizeof(*tile));
-	if(tile == NULL) {
-		printf("Error allocating memory for the tile\n");
-		exit(1);
+/* Frees the CPU copy of the geometry of the meshes of 'model', they are drawn from the buffers
+ * already uploaded to the GPU and the physics keeps its own compact copy of the triangles.
+ * The indices are kept, raylib draws a mesh as indexed only when they are not NULL */
+void freeModelGeometry(Model *model) {
+	for(int i = 0; i < model->meshCount; i++) {
+		Mesh *m = &model->meshes[i];
+		MemFree(m->vertices);
+		MemFree(m->texcoords);
+		MemFree(m->normals);
+		m->vertices = NULL;
+		m->texcoords = NULL;
+		m->normals = NULL;
 	}
-	tile->position = (Vector3) {
-		.x = posX - CELL_SIZE / 2,
-		.y = posY - 0.001f,
-		.z = posZ - CELL_SIZE / 2
-	};
-
-
-	tile->texture = texture;
-	tile->model = LoadModelFromMesh(GenMeshPlane(CELL_SIZE, CELL_SIZE, 1, 1));
-	tile->model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = *texture;
+}
 
-	Mesh mesh = tile->model.meshes[0];
-	for(int i = 0; i < mesh.vertexCount; i++) {
-		mesh.vertices[i * 3    ] += tile->position.x;
-		mesh.vertices[i * 3 + 1] += tile->position.y;
-		mesh.vertices[i * 3 + 2] += tile->position.z;
+/* Packs the 'count' images at 'paths' in a texture atlas, they must have the same size. The texture
+ * i goes in the column i % TILE_ATLAS_SIZE and in the row i / TILE_ATLAS_SIZE of the atlas */
+Texture2D loadTileAtlas(const char **paths, int count) {
+	if(count > TILE_ATLAS_SIZE * TILE_ATLAS_SIZE) {
+		printf("Error the tile atlas can't hold %d textures\n", count);
+		exit(1);
+	}
+	Image first = LoadImage(paths[0]);
+	int width = first.width, height = first.height;
+	Image atlas = GenImageColor(width * TILE_ATLAS_SIZE, height * TILE_ATLAS_SIZE, BLANK);
+	for(int i = 0; i < count; i++) {
+		Image image = i == 0 ? first : LoadImage(paths[i]);
+		if(image.width != width || image.height != height) {
+			printf("Error the tile texture %s is not %d x %d\n", paths[i], width, height);
+			exit(1);
+		}
+		Rectangle source = (Rectangle) { 0, 0, width, height };
+		Rectangle dest = (Rectangle) { (i % TILE_ATLAS_SIZE) * width, (i / TILE_ATLAS_SIZE) * height, width, height };
+		ImageDraw(&atlas, image, source, dest, WHITE);
+		UnloadImage(image);
 	}
+	ImageMipmaps(&atlas);
+	Texture2D texture = LoadTextureFromImage(atlas);
+	UnloadImage(atlas);
+	SetTextureFilter(texture, TEXTURE_FILTER_ANISOTROPIC_16X);
+	return texture;
+}
 
-	UpdateMeshBuffer(mesh, 0, mesh.vertices, mesh.vertexCount * 3 * sizeof(float), 0);
+/* Creates the mesh of the tiles from 'x0', 'y0' to 'x1', 'y1' (excluded) of a grid of 'cols' x 'rows'
+ * tiles. Each tile is a quad like the ones of GenMeshPlane, with its texture picked in the atlas by
+ * its texture coordinates. If 'terrain' is not NULL the tile vertices are moved on the terrain surface */
+Mesh createTileChunkMesh(int cols, int rows, int x0, int y0, int x1, int y1, int *textures, Texture2D atlas, RigidBody *terrain) {
+	int tileCount = (x1 - x0) * (y1 - y0);
+	Mesh mesh = { 0 };
+	mesh.vertexCount = tileCount * 4;
+	mesh.triangleCount = tileCount * 2;
+	mesh.vertices = MemAlloc(sizeof(float) * 3 * mesh.vertexCount);
+	mesh.texcoords = MemAlloc(sizeof(float) * 2 * mesh.vertexCount);
+	mesh.normals = MemAlloc(sizeof(float) * 3 * mesh.vertexCount);
+	mesh.indices = MemAlloc(sizeof(unsigned short) * 3 * mesh.triangleCount);
+
+	float sizeX = cols * CELL_SIZE;
+	float sizeY = rows * CELL_SIZE;
+	// half a texel is left out around each texture, so the tiles don't sample their neighbours in the atlas
+	float insetU = 0.5f * TILE_ATLAS_SIZE / atlas.width;
+	float insetV = 0.5f * TILE_ATLAS_SIZE / atlas.height;
+	int v = 0, t = 0;
+	for(int y = y0; y < y1; y++) {
+		for(int x = x0; x < x1; x++) {
+			// the tile is drawn one cell left and one cell back from its grid point
+			float posZ =  + (sizeY / 2) - sizeY * (1.0f / rows) * y;
+			float posX =  - (sizeX / 2) + sizeX * (1.0f / cols) * x;
+			Vector3 center = (Vector3) { posX - CELL_SIZE / 2, -0.001f, posZ - CELL_SIZE / 2 };
+			int texture = textures[x + y * cols];
+			float u0 = (float)(texture % TILE_ATLAS_SIZE) / TILE_ATLAS_SIZE + insetU;
+			float v0 = (float)(texture / TILE_ATLAS_SIZE) / TILE_ATLAS_SIZE + insetV;
+			float du = 1.0f / TILE_ATLAS_SIZE - 2 * insetU;
+			float dv = 1.0f / TILE_ATLAS_SIZE - 2 * insetV;
+
+			// the corners go along x and then along z, the first one is the lower x and z
+			for(int k = 0; k < 4; k++) {
+				int cx = k % 2, cz = k / 2;
+				float *vertex = &mesh.vertices[(v + k) * 3];
+				float *normal = &mesh.normals[(v + k) * 3];
+				vertex[0] = (cx - 0.5f) * CELL_SIZE + center.x;
+				vertex[1] = center.y;
+				vertex[2] = (cz - 0.5f) * CELL_SIZE + center.z;
+				mesh.texcoords[(v + k) * 2    ] = u0 + cx * du;
+				mesh.texcoords[(v + k) * 2 + 1] = v0 + cz * dv;
+
+				Vector3 n = (Vector3) { 0, 1, 0 };
+				if(terrain) {
+					vertex[1] += getHeightfieldHeight(terrain, vertex[0], vertex[2]);
+					n = getHeightfieldNormal(terrain, vertex[0], vertex[2]);
+				}
+				normal[0] = n.x;
+				normal[1] = n.y;
+				normal[2] = n.z;
+			}
 
-	return tile;
+			// the same triangles as GenMeshPlane
+			unsigned short quad[6] = { 2, 1, 0, 2, 3, 1 };
+			for(int k = 0; k < 6; k++) mesh.indices[t++] = v + quad[k];
+			v += 4;
+		}
+	}
+	UploadMesh(&mesh, false);
+	return mesh;
 }
 
-TileGrid *createTileGrid(int cols, int rows) {
-	TileGrid *tileGrid = malloc(sizeof(*tileGrid)+sizeof(Tile*)*rows*cols);
+/* Creates a grid of 'cols' x 'rows' tiles, 'textures' holds the index in the atlas of the texture of
+ * each tile, row by row. If 'terrain' is not NULL the tiles follow the terrain surface */
+TileGrid *createTileGrid(int cols, int rows, int *textures, Texture2D atlas, RigidBody *terrain) {
+	int chunkCols = (cols + TILE_CHUNK_SIZE - 1) / TILE_CHUNK_SIZE;
+	int chunkRows = (rows + TILE_CHUNK_SIZE - 1) / TILE_CHUNK_SIZE;
+	TileGrid *tileGrid = malloc(sizeof(*tileGrid) + sizeof(TileChunk) * chunkCols * chunkRows);
+	if(tileGrid == NULL) {
+		printf("Error allocating memory for the tile grid\n");
+		exit(1);
+	}
 	tileGrid->cols = cols;
 	tileGrid->rows = rows;
+	tileGrid->atlas = atlas;
+	tileGrid->chunkCount = chunkCols * chunkRows;
+
+	for(int cy = 0; cy < chunkRows; cy++) {
+		for(int cx = 0; cx < chunkCols; cx++) {
+			int x0 = cx * TILE_CHUNK_SIZE, y0 = cy * TILE_CHUNK_SIZE;
+			int x1 = x0 + TILE_CHUNK_SIZE < cols ? x0 + TILE_CHUNK_SIZE : cols;
+			int y1 = y0 + TILE_CHUNK_SIZE < rows ? y0 + TILE_CHUNK_SIZE : rows;
+			TileChunk *chunk = &tileGrid->chunks[cx + cy * chunkCols];
+			chunk->model = LoadModelFromMesh(createTileChunkMesh(cols, rows, x0, y0, x1, y1, textures, atlas, terrain));
+			chunk->model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = atlas;
+			chunk->box = GetModelBoundingBox(chunk->model);
+			// the tiles never change, they are drawn from the GPU buffers
+			freeModelGeometry(&chunk->model);
+		}
+	}
+	return tileGrid;
 }
 
-void drawTileGrid(TileGrid *grid) {
-	for(int x = 0; x < grid->cols * grid->rows; x++) {
-		Tile *tile = grid->tiles[x];
-		DrawModel(tile->model, zero_pos, 1.0f, WHITE);
-	}
+/* Draws the chunks of the grid inside the frustum 'f' */
+void drawTileGrid(TileGrid *grid, Frustum *f) {
+	for(int i = 0; i < grid->chunkCount; i++)
+		if(cullBox(f, grid->chunks[i].box)) DrawModel(grid->chunks[i].model, zero_pos, 1.0f, WHITE);
 }
 
 void setTileGridShader(TileGrid *grid, Shader *shader) {
-	int tilesCount = grid->rows * grid->cols;
-	for(int i = 0; i < tilesCount; i++) 
-		grid->tiles[i]->model.materials[0].shader = *shader;
+	for(int i = 0; i < grid->chunkCount; i++)
+		grid->chunks[i].model.materials[0].shader = *shader;
+}
+
+/* Returns the bounding box of 'model' drawn at 'position', the model must still have its vertices */
+BoundingBox getModelBoundingBoxAt(Model model, Vector3 position) {
+	BoundingBox box = GetModelBoundingBox(model);
+	box.min = Vector3Add(box.min, position);
+	box.max = Vector3Add(box.max, position);
+	return box;
+}
+
+/* Draws the counts of the objects and chunks drawn and culled in the last frame and the number
+ * of uniform values uploaded to the shaders */
+void drawDrawStats(int shaderUploads) {
+	DrawStats s = getDrawStats();
+	DrawText(TextFormat("objects: %d visible, %d culled", s.visibleObjects, s.culledObjects), 10, 10, 20, WHITE);
+	DrawText(TextFormat("chunks: %d visible, %d culled", s.visibleChunks, s.culledChunks), 10, 35, 20, WHITE);
+	DrawText(TextFormat("uniform uploads: %d", shaderUploads), 10, 60, 20, WHITE);
 }
 
 Grid *createGrid(int cols, int rows, float cellSize) {
@@ -177,10 +312,6 @@ void drawGrid(Grid *g, Color c) {
 	}
 }
 
-void setTileInTileGrid(TileGrid *grid, Tile *tile, int x, int y) {
-	grid->tiles[x+y*grid->cols] = tile;
-}
-
 Camera3D camera = {0};
 #if ISOMETRIC
 	const Vector3 cameraDirection = (Vector3) { 0.0f, -0.6f, -1.0f };
@@ -197,9 +328,36 @@ Entity2D player = {
 	.size     = (Vector2) { 0.3f, 0.3f }//,  0.1f }
 };
 
-RigidBody *bridgeBody;
-RigidBody *bridgeBody2;
-RigidBody *treeBody[TREES];
+BodyHandle bridgeBody;
+BodyHandle bridgeBody2;
+// F5 shows the counts of the objects drawn and culled
+int showDrawStats = 0;
+BodyHandle treeBody[TREES];
+
+/* Writes the physics stats of the last steps to 'path' using 'write' */
+void dumpPhysicsTrace(const char *path, void (*write)(FILE *f)) {
+	FILE *f = fopen(path, "w");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR cannot write the physics trace to %s\n", path);
+		return;
+	}
+	write(f);
+	fclose(f);
+	printf("Physics trace written to %s\n", path);
+}
+
+/* Starts recording the physics to PHYSICS_RECORDING, or stops the recording in progress */
+void togglePhysicsRecording(void) {
+	static int recording = 0;
+	if(recording) {
+		stopPhysicsRecording();
+		recording = 0;
+		printf("Physics recording written to %s\n", PHYSICS_RECORDING);
+	} else if(startPhysicsRecording(PHYSICS_RECORDING)) {
+		recording = 1;
+		printf("Recording the physics to %s\n", PHYSICS_RECORDING);
+	}
+}
 
 void handleInputs(AnimatedSprite *a) {
 	float speed = cameraSpeed;
@@ -210,7 +368,7 @@ void handleInputs(AnimatedSprite *a) {
 		speed = sprintSpeed;
 		a->frameTimer += GetFrameTime();
 	}
-	player.body->vel = speedV;
+	getRigidBody(player.body)->vel = speedV;
 	if(IsKeyDown(KEY_W)) {
 		speedV.z  = -speed;
 		switchAnimationType(a, WALK_U_ANIM);
@@ -231,9 +389,13 @@ void handleInputs(AnimatedSprite *a) {
 		switchAnimationType(a, a->currAnimation - 4); // each walk animation is idle animation + 4
 	}
 
-	player.body->vel = speedV;
+	getRigidBody(player.body)->vel = speedV;
 	
 	if(IsKeyPressed(KEY_F1)) ToggleFullscreen();
+	if(IsKeyPressed(KEY_F2)) dumpPhysicsTrace("physics_trace.csv", writePhysicsTraceCSV);
+	if(IsKeyPressed(KEY_F3)) dumpPhysicsTrace("physics_trace.json", writePhysicsTraceJSON);
+	if(IsKeyPressed(KEY_F4)) togglePhysicsRecording();
+	if(IsKeyPressed(KEY_F5)) showDrawStats = !showDrawStats;
 }
 
 Entity createEntity(Texture2D texture, Vector3 pos, Vector3 size) {
@@ -272,40 +434,31 @@ int main(void)
 	int cols = 100;
 	
 	Grid *grid = createGrid(cols, rows, CELL_SIZE);
-	TileGrid *tileGrid = createTileGrid(cols, rows);
-	Image tileImage1 = LoadImage("res/grass1.png");
-	ImageMipmaps(&tileImage1);
-	Texture2D tileTexture1 = LoadTextureFromImage(tileImage1);
-	UnloadImage(tileImage1);
-	Image tileImage2 = LoadImage("res/grass2.png");
-	ImageMipmaps(&tileImage2);
-	Texture2D tileTexture2 = LoadTextureFromImage(tileImage2);
-	UnloadImage(tileImage2);
-	Image tileImage3 = LoadImage("res/grass3.png");
-	ImageMipmaps(&tileImage3);
-	Texture2D tileTexture3 = LoadTextureFromImage(tileImage3);
-	UnloadImage(tileImage3);
-	Image tileImage4 = LoadImage("res/grass4.png");
-	ImageMipmaps(&tileImage4);
-	Texture2D tileTexture4 = LoadTextureFromImage(tileImage4);
-	UnloadImage(tileImage4);
-	for(int y = 0; y < tileGrid->rows; y++) {
-		for(int x = 0; x < tileGrid->cols; x++) {
-			float sizeY = rows * CELL_SIZE;
-			float sizeX = cols * CELL_SIZE;
-			float posZ =  + (sizeY / 2) - sizeY * (1.0f / rows) * y;
-			float posX =  - (sizeX / 2) + sizeX * (1.0f / cols) * x;
-			int textureIndex = GetRandomValue(1, 4);
-			Tile *tile;
-			switch(textureIndex) {
-				case 1: tile = createTile(&tileTexture1, posX, 0, posZ); break;
-				case 2: tile = createTile(&tileTexture2, posX, 0, posZ); break;
-				case 3: tile = createTile(&tileTexture3, posX, 0, posZ); break;
-				case 4: tile = createTile(&tileTexture4, posX, 0, posZ); break;
-			}
-			setTileInTileGrid(tileGrid, tile, x, y);
+	const char *tileTexturePaths[] = { "res/grass1.png", "res/grass2.png", "res/grass3.png", "res/grass4.png" };
+	Texture2D tileAtlas = loadTileAtlas(tileTexturePaths, 4);
+	/* terrain: the heightfield corners are the tile corners, the tiles
+	 * are drawn from one cell left of the center of the grid */
+	float *terrainHeights = malloc(sizeof(*terrainHeights) * (cols + 1) * (rows + 1));
+	for(int z = 0; z <= rows; z++) {
+		for(int x = 0; x <= cols; x++) {
+			float noise = stb_perlin_fbm_noise3(x * TERRAIN_NOISE_STEP, 0, z * TERRAIN_NOISE_STEP, 2.0f, 0.5f, 4);
+			// the ground under the terrain is still at 0, so the terrain never goes below
+			terrainHeights[x + z * (cols + 1)] = Clamp((noise + 1) / 2, 0, 1) * TERRAIN_HEIGHT;
 		}
 	}
+	Vector3 terrainPos = (Vector3) { -cols * CELL_SIZE / 2 - CELL_SIZE, 0, -rows * CELL_SIZE / 2 };
+	BodyHandle terrainBody = createRigidBodyFromHeightfield(createHeightfield(cols, rows, CELL_SIZE, terrainHeights), terrainPos);
+	RigidBody *terrain = getRigidBody(terrainBody);
+	free(terrainHeights);
+
+	int *tileTextures = malloc(sizeof(*tileTextures) * cols * rows);
+	for(int y = 0; y < rows; y++) {
+		for(int x = 0; x < cols; x++) {
+			tileTextures[x + y * cols] = GetRandomValue(1, 4) - 1;
+		}
+	}
+	TileGrid *tileGrid = createTileGrid(cols, rows, tileTextures, tileAtlas, terrain);
+	free(tileTextures);
 
 	#if ISOMETRIC
 	 	camera.position = (Vector3){
@@ -327,11 +480,14 @@ int main(void)
 	camera.fovy = 45.0f;
 	camera.projection = CAMERA_PERSPECTIVE;
 
-	Shader lightFSShader = LoadShader("res/shaders/light.vs", "res/shaders/light.fs");
-	Shader lightNoTexShader = LoadShader("res/shaders/light.vs", "res/shaders/lightNoTex.fs");
-	Shader leavesShader = LoadShader("res/shaders/light.vs", "res/shaders/transparency.fs");
-
-	Vector4 color = (Vector4) { 1.0f, 0.0f, 0.0f, 1.0f };
+	// the shaders are loaded in the registry, which sets their lights and time once per frame
+	Shader lightFSShader = loadShaderProgram("res/shaders/light.vs", "res/shaders/light.fs")->shader;
+	Shader lightNoTexShader = loadShaderProgram("res/shaders/light.vs", "res/shaders/lightNoTex.fs")->shader;
+	Shader leavesShader = loadShaderProgram("res/shaders/light.vs", "res/shaders/transparency.fs")->shader;
+	// the leaves billboards are turned to the camera by the vertex shader
+	Shader leavesBillboardShader = loadShaderProgram("res/shaders/billboard.vs", "res/shaders/transparency.fs")->shader;
+	// the props are drawn with the same lighting, the model matrix comes from each instance
+	Shader lightInstancedShader = loadShaderProgram("res/shaders/lightInstanced.vs", "res/shaders/light.fs")->shader;
 
 	//Vector3 lightColor      = (Vector3) { 0, 0, 0 };
 	Vector3 lightColor      = (Vector3) { 0.6f, 0.3f, 0.4f };
@@ -345,25 +501,23 @@ int main(void)
 	AnimatedSprite *aSprite = createAnimatedSprite(sprite, frames, 4);
 	freeAnimationConfig(config);
 
+	Texture2D leavesTexture = LoadTexture("res/leaves.png");
+	SetTextureFilter(leavesTexture, TEXTURE_FILTER_ANISOTROPIC_16X);
+
+	// the leaves never move, they are uploaded once and drawn with a single instanced draw
+	BillboardBatch *leaves = createBillboardBatch(leavesTexture, leavesBillboardShader);
 	int count = rows*cols/3;
-	Vector3 billboardsPositions[count];
 	for(int i = 0; i < count; i++) {
 		float x = (GetRandomValue(0, cols) - cols / 2) * CELL_SIZE;
 		float z = (GetRandomValue(0, rows) - rows / 2) * CELL_SIZE + CELL_SIZE / 2;
-		billboardsPositions[i] = (Vector3) {
+		Vector3 position = (Vector3) {
 			.x = x,
-			.y = CELL_SIZE / 2,
+			.y = getHeightfieldHeight(getRigidBody(terrainBody), x, z) + CELL_SIZE / 2,
 			.z = z
 		};
+		addBillboard(leaves, position, (Vector2) { CELL_SIZE, CELL_SIZE }, (Rectangle) { 0, 0, leavesTexture.width, leavesTexture.height });
 	}
 
-	Texture2D leavesTexture = LoadTexture("res/leaves.png");
-
-	SetTextureFilter(tileTexture1, TEXTURE_FILTER_ANISOTROPIC_16X);
-	SetTextureFilter(tileTexture2, TEXTURE_FILTER_ANISOTROPIC_16X);
-	SetTextureFilter(tileTexture3, TEXTURE_FILTER_ANISOTROPIC_16X);
-	SetTextureFilter(tileTexture4, TEXTURE_FILTER_ANISOTROPIC_16X);
-	SetTextureFilter(leavesTexture, TEXTURE_FILTER_ANISOTROPIC_16X);
 	//Color background = (Color) {99, 155, 255, 255};
 	Color background = (Color) {floor(255 * lightColor.x), floor(255 * lightColor.y), floor(255 * lightColor.z), 255};
 	setTileGridShader(tileGrid, &lightFSShader);
@@ -379,11 +533,16 @@ int main(void)
 	Rectangle source = (Rectangle) { 0, 0, resolution.x, -resolution.y };
 	Rectangle dest   = (Rectangle) { 0, 0, resolution.x,  resolution.y };
 
-	Shader canvasShader = LoadShader("res/shaders/light.vs", "res/shaders/test.fs");
-	SetShaderValue(canvasShader, GetShaderLocation(canvasShader, "resolution"), &resolution, SHADER_UNIFORM_VEC2);
+	ShaderProgram *canvasProgram = loadShaderProgram("res/shaders/light.vs", "res/shaders/test.fs");
+	setShaderUniform(canvasProgram, UNIFORM_RESOLUTION, &resolution);
+	Shader canvasShader = canvasProgram->shader;
 	// player	
 	Vector3 pSize = (Vector3){ .x = player.size.x * 0.7f, .y = player.size.y, .z = player.size.x * 0.7f };
+	float playerGround = getHeightfieldHeight(getRigidBody(terrainBody), player.position.x, player.position.z);
+	player.position.y += playerGround;
+	camera.position.y += playerGround;
 	player.body = createRigidBody(RIGID, player.position, pSize);
+	setFixedTimestep(1.0f / PHYSICS_RATE, PHYSICS_MAX_SUBSTEPS);
 
 	// loading obj model
 	Model bridge = LoadModel("res/objs/bridge.obj");
@@ -394,8 +553,8 @@ int main(void)
 	bridge.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = bridgeTexture;
 	Vector3 bridgePos = (Vector3){ -2.0f, 0, -9.0f };
 	bridgeBody = createRigidBodyFromMesh(RIGID_FIXED, bridge.meshes, bridge.meshCount, bridgePos);
-	bridgePos.y = 0 - bridgeBody->box.v[0].y - 0.55f;
-	updateRigidBodyPosition(bridgeBody, bridgePos);
+	bridgePos.y = getHeightfieldHeight(getRigidBody(terrainBody), bridgePos.x, bridgePos.z) - getRigidBody(bridgeBody)->box.v[0].y - 0.55f;
+	updateRigidBodyPosition(getRigidBody(bridgeBody), bridgePos);
 	
 	Model bridge2 = LoadModel("res/objs/bridge2.obj");
 	Material *bridgeMaterial2 = LoadMaterials("res/objs/bridge2.mtl", &bridge2.materialCount);
@@ -404,8 +563,8 @@ int main(void)
 	bridge2.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = bridgeTexture;
 	Vector3 bridgePos2 = (Vector3){ 0, 0, -4.0f }; 
 	bridgeBody2 = createRigidBodyFromMesh(RIGID_FIXED, bridge2.meshes, bridge2.meshCount, bridgePos2);
-	bridgePos2.y = 0 - bridgeBody2->box.v[0].y - 0.01f;
-	updateRigidBodyPosition(bridgeBody2, bridgePos2);
+	bridgePos2.y = getHeightfieldHeight(getRigidBody(terrainBody), bridgePos2.x, bridgePos2.z) - getRigidBody(bridgeBody2)->box.v[0].y - 0.01f;
+	updateRigidBodyPosition(getRigidBody(bridgeBody2), bridgePos2);
 
 	/* DEBUG 
 	Mesh m = bridge2.meshes[0];
@@ -426,7 +585,7 @@ int main(void)
 	 DEBUG */
 	Model tree= LoadModel("res/objs/tree.obj");
 	printf("Model loaded\n");
-	for(int i = 0; i < tree.materialCount; i++) tree.materials[i].shader = lightFSShader;
+	for(int i = 0; i < tree.materialCount; i++) tree.materials[i].shader = lightInstancedShader;
 	Vector3 treePos[TREES];
 	for(int i = 0; i < TREES; i++) {
 		treePos[i] = (Vector3) { 
@@ -435,24 +594,37 @@ int main(void)
 			GetRandomValue(-cols / 2, cols/2) * CELL_SIZE	
 		};
 		treeBody[i] = createRigidBodyFromMesh(RIGID_FIXED, tree.meshes, tree.meshCount, treePos[i]);
-		treePos[i].y = 0 - treeBody[i]->box.v[0].y;
-		Vector3 tPos = treeBody[i]->pos;
+		RigidBody *t = getRigidBody(treeBody[i]);
+		treePos[i].y = getHeightfieldHeight(getRigidBody(terrainBody), treePos[i].x, treePos[i].z) - t->box.v[0].y;
+		Vector3 tPos = t->pos;
 		tPos.y = treePos[i].y;
-		updateRigidBodyPosition(treeBody[i], tPos);
-
-		if(checkCollisionAABB(bridgeBody, treeBody[i]).baseLength > 0 || checkCollisionAABB(bridgeBody2, treeBody[i]).baseLength > 0) {
+		updateRigidBodyPosition(t, tPos);
+
+		// keep the trees off the bridges and apart from each other, the terrain is not a mesh so it's left out
+		PhysicsQuery q = {
+			.type = QUERY_BOX,
+			.origin = t->box.wCenter,
+			.halfSize = Vector3Scale(Vector3Subtract(t->box.v[2], t->box.v[4]), 0.5f),
+			.shapes = 1 << SHAPE_MESH,
+			.ignore = treeBody[i]
+		};
+		QueryResult hit;
+		runPhysicsQueries(&q, &hit, 1);
+		if(hit.hits > 0) {
 			freeRigidBody(treeBody[i]);
 			i--;
-			continue;
-		}
-		for(int j = 0; j < i; j++) {
-			if(checkCollisionAABB(treeBody[i], treeBody[j]).baseLength > 0) {
-				freeRigidBody(treeBody[i]);
-				i--;
-				break;
-			}
 		}
 	}
+	// all the trees are drawn with an instanced draw per mesh
+	PropBatch *trees = createPropBatch(tree, lightInstancedShader);
+	for(int i = 0; i < TREES; i++) addProp(trees, MatrixTranslate(treePos[i].x, treePos[i].y, treePos[i].z));
+	BoundingBox bridgeBox = getModelBoundingBoxAt(bridge, bridgePos);
+	BoundingBox bridgeBox2 = getModelBoundingBoxAt(bridge2, bridgePos2);
+	// bridges and trees don't move, their triangles are merged in a single structure
+	if(bakeStaticWorld(STATIC_WORLD_CACHE)) printf("Static world loaded from %s\n", STATIC_WORLD_CACHE);
+	freeModelGeometry(&bridge);
+	freeModelGeometry(&bridge2);
+	freeModelGeometry(&tree);
 
 	// Christmas snowflakes
 	int flakes = 0;
@@ -477,60 +649,45 @@ int main(void)
 
     while (!WindowShouldClose())
     {
+		resetDrawStats();
+		// the lights and the time are the same for all the shaders, only the values changed are uploaded
+		FrameConstants frame = {
+			.time = GetTime() + 1.0f / GetRandomValue(4, 10),
+			.lightColor = lightColor,
+			.ambient = ambient,
+			.localLight = player.position,
+			.localLightColor = localLightColor
+		};
+		setFrameConstants(&frame);
+		int shaderUploads = getShaderUploads();
+
         BeginTextureMode(canvas);
 		ClearBackground(background);
 		BeginMode3D(camera);
+		// everything is culled against the camera frustum before being drawn
+		Frustum frustum = getFrustum();
 		//drawGrid(grid, BLACK);
-		drawTileGrid(tileGrid);
+		drawTileGrid(tileGrid, &frustum);
 		BeginShaderMode(lightFSShader);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "colDiffuse"), &color, SHADER_UNIFORM_VEC4);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "localLight"), &player.position, SHADER_UNIFORM_VEC3);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "localLightColor"), &localLightColor, SHADER_UNIFORM_VEC3);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "lightColor"), &lightColor, SHADER_UNIFORM_VEC3);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "ambient"), &ambient, SHADER_UNIFORM_VEC3);
-
-		float time = GetTime() + 1.0f / GetRandomValue(4, 10);
-		SetShaderValue(lightFSShader, GetShaderLocation(lightFSShader, "time"), &time, SHADER_UNIFORM_FLOAT);
-
 		Vector3 rotAxis = (Vector3){ 0.0f, 1.0f, 0.0f };
 		Vector3 scale = (Vector3) { 1.0f, 1.0f, 1.0f };
 		// DrawingBridge
 		
-		DrawModelEx(bridge, bridgePos, rotAxis, 0,  scale, WHITE);
-		DrawModelEx(bridge2, bridgePos2, rotAxis, 0,  scale, WHITE);
-		for(int i = 0; i < TREES; i++) {
-			DrawModelEx(tree, treePos[i], rotAxis, 0, scale, WHITE);
-			Box b = treeBody[i]->box;
-			/*DrawCubeV(treePos[i],
-					 Vector3Subtract(b.maxSize, b.minSize),
-					 RED);*/
-		}
+		if(cullBox(&frustum, bridgeBox)) DrawModelEx(bridge, bridgePos, rotAxis, 0,  scale, WHITE);
+		if(cullBox(&frustum, bridgeBox2)) DrawModelEx(bridge2, bridgePos2, rotAxis, 0,  scale, WHITE);
 
 		// Draw snowflakes
 		for(int i = 0; i < flakes; i++) DrawModel(snow[i].model, snow[i].position, 1.0f, WHITE);
 		EndShaderMode();
-		BeginShaderMode(leavesShader);
-		Vector3 billboardLightPosition = (Vector3) { player.position.x, player.position.y, player.position.z };
-		SetShaderValue(leavesShader, GetShaderLocation(leavesShader, "localLight"), &billboardLightPosition, SHADER_UNIFORM_VEC3);
-		SetShaderValue(leavesShader, GetShaderLocation(leavesShader, "time"), &time, SHADER_UNIFORM_FLOAT);
-		SetShaderValue(leavesShader, GetShaderLocation(leavesShader, "localLightColor"), &localLightColor, SHADER_UNIFORM_VEC3);
-		SetShaderValue(leavesShader, GetShaderLocation(leavesShader, "lightColor"), &lightColor, SHADER_UNIFORM_VEC3);
-		SetShaderValue(leavesShader, GetShaderLocation(leavesShader, "ambient"), &ambient, SHADER_UNIFORM_VEC3);
-		drawAnimatedSpriteBillboard(aSprite, camera, player.position, player.size, GetFrameTime());
-		
-		for(int i = 0; i < count; i++) 
-			DrawBillboardPro(camera, 
-			 				 leavesTexture,
-							 (Rectangle) { 0, 0, leavesTexture.width, leavesTexture.height },
-							 billboardsPositions[i],
-							 (Vector3) { 0, 1, 0 },
-							 (Vector2) { CELL_SIZE, CELL_SIZE },
-							 (Vector2) { CELL_SIZE / 2, CELL_SIZE / 2 },
-							 0.0f,
-							 WHITE);
 
+		// the batches enable their own shader
+		drawPropBatch(trees, &frustum);
 
+		BeginShaderMode(leavesShader);
+		drawAnimatedSpriteBillboard(aSprite, camera, player.position, player.size, GetFrameTime());
 		EndShaderMode();
+
+		drawBillboardBatch(leaves, &frustum);
 		EndMode3D();
 	
 		DrawPixel(10, 10, RED);
@@ -539,6 +696,7 @@ int main(void)
 		BeginShaderMode(canvasShader);
 		DrawTexturePro(canvas.texture, source, dest, origin, 0, WHITE);
 		EndShaderMode();
+		if(showDrawStats) drawDrawStats(shaderUploads);
 		//DrawFPS(100, 100);
         EndDrawing();
 
@@ -553,15 +711,19 @@ int main(void)
 			if(snow[i].position.y < 0) snow[i].position.y = snowInitialY;
 		}
 
-		// update physic simulation
-		updateWorld(frameTime);
-		Vector3 diff = Vector3Subtract(player.position, player.body->pos);
-		player.position = player.body->pos; 
+		// update physic simulation, the player is drawn between the last two steps
+		stepWorld(frameTime);
+		Vector3 playerPosition = getInterpolatedPosition(getRigidBody(player.body));
+		Vector3 diff = Vector3Subtract(player.position, playerPosition);
+		player.position = playerPosition;
 		camera.position = Vector3Subtract(camera.position, diff);
 		camera.target = Vector3Add(cameraDirection, camera.position);
     }
 
-	UnloadShader(lightFSShader);
+	stopPhysicsRecording();
+	freePropBatch(trees);
+	freeBillboardBatch(leaves);
+	unloadShaderPrograms();
     CloseWindow();
 
     return 0;
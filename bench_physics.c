@@ -0,0 +1,344 @@
+#include "physics.h"
+#include "utils.h"
+#include "raylib/src/raymath.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Headless benchmark of the whole physics step. It builds a scene of boxes walking among copies
+ * of the bridge and tree collision meshes, steps the world for a fixed number of frames and
+ * reports the time per step and the work done by the broadphase and the narrowphase.
+ *
+ * usage: bench_physics [boxes] [bridges] [trees] [frames] [threads] [moving %] [trace file]
+ * the stats of the last steps are written to the trace file if given, as JSON if its name
+ * ends with .json and as CSV otherwise.
+ *
+ * usage: bench_physics record <recording> [boxes] [bridges] [trees] [frames] [threads] [moving %]
+ * runs the same benchmark and records it, to be replayed like the recordings made by the game.
+ *
+ * usage: bench_physics replay <recording> [threads] [timings file]
+ * replays a recording and prints the time of each frame, as CSV in the timings file if given,
+ * then the checksum of the world, which must be the one of the recorded run. It fails if
+ * they differ, so it catches changes of behavior as well as slowdowns.
+ *
+ * usage: bench_physics settle [boxes] [frames]
+ * pushes rows of boxes against a fixed wall every frame, like a player walking into it, and
+ * fails if they are not all asleep after the given number of frames.
+ *
+ * usage: bench_physics stack [height] [frames]
+ * builds two piles of boxes on a fixed floor, one created from the bottom up and one from the
+ * top down, and fails if a pile sank or isn't asleep after the given number of frames, so the
+ * result can't depend on the order the boxes were created in */
+
+#define FRAME_TIME (1.0f / 60)
+#define BOX_SPEED 1.0f
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float randomFloat(float min, float max) {
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+/* Loads the vertices of the OBJ file at 'path' as a single mesh of unindexed triangles,
+ * polygons are split in triangle fans. Only the positions are read, that's all the physics needs */
+static Mesh loadObjCollisionMesh(const char *path) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR cannot open %s\n", path);
+		exit(1);
+	}
+
+	int positionCount = 0, positionCapacity = 1024;
+	float *positions = xmalloc(sizeof(float) * 3 * positionCapacity);
+	int triangleCount = 0, triangleCapacity = 1024;
+	float *vertices = xmalloc(sizeof(float) * 9 * triangleCapacity);
+
+	char line[1024];
+	while(fgets(line, sizeof(line), f)) {
+		if(line[0] == 'v' && line[1] == ' ') {
+			if(positionCount == positionCapacity) {
+				positionCapacity *= 2;
+				positions = xrealloc(positions, sizeof(float) * 3 * positionCapacity);
+			}
+			float *p = &positions[positionCount * 3];
+			sscanf(line + 2, "%f %f %f", &p[0], &p[1], &p[2]);
+			positionCount++;
+		}
+		else if(line[0] == 'f' && line[1] == ' ') {
+			// each corner is "v", "v/vt", "v//vn" or "v/vt/vn", only v is used
+			int corners[64];
+			int cornerCount = 0;
+			for(char *token = strtok(line + 2, " \t\r\n"); token && cornerCount < 64; token = strtok(NULL, " \t\r\n")) {
+				int index = atoi(token);
+				corners[cornerCount++] = index < 0 ? positionCount + index : index - 1;
+			}
+			for(int k = 1; k + 1 < cornerCount; k++) {
+				if(triangleCount == triangleCapacity) {
+					triangleCapacity *= 2;
+					vertices = xrealloc(vertices, sizeof(float) * 9 * triangleCapacity);
+				}
+				int triangle[3] = { corners[0], corners[k], corners[k + 1] };
+				for(int q = 0; q < 3; q++) {
+					if(triangle[q] < 0 || triangle[q] >= positionCount) {
+						fprintf(stderr, "ERROR invalid face in %s\n", path);
+						exit(1);
+					}
+					memcpy(&vertices[triangleCount * 9 + q * 3], &positions[triangle[q] * 3], sizeof(float) * 3);
+				}
+				triangleCount++;
+			}
+		}
+	}
+	fclose(f);
+	free(positions);
+
+	Mesh mesh = { 0 };
+	mesh.vertexCount = triangleCount * 3;
+	mesh.triangleCount = triangleCount;
+	mesh.vertices = vertices;
+	return mesh;
+}
+
+/* Creates a RIGID_FIXED body from 'mesh' standing on the ground at 'x', 'z' */
+static void placeStatic(Mesh *mesh, float x, float z) {
+	RigidBody *r = getRigidBody(createRigidBodyFromMesh(RIGID_FIXED, mesh, 1, (Vector3) { x, 0, z }));
+	updateRigidBodyPosition(r, (Vector3) { x, -r->box.v[4].y, z });
+}
+
+static int replay(const char *path, int threads, const char *timingsPath) {
+	setPhysicsThreads(threads);
+	PhysicsReplay *replay = openPhysicsReplay(path);
+	if(replay == NULL) return 1;
+
+	FILE *timings = stdout;
+	if(timingsPath) {
+		timings = fopen(timingsPath, "w");
+		if(timings == NULL) {
+			fprintf(stderr, "ERROR cannot write %s\n", timingsPath);
+			exit(1);
+		}
+	}
+	fprintf(timings, "frame,steps,time_us\n");
+
+	double minFrame = 1e9, maxFrame = 0, total = 0;
+	for(;;) {
+		double start = now();
+		int steps = replayPhysicsFrame(replay);
+		double frame = now() - start;
+		if(steps < 0) break;
+
+		total += frame;
+		if(frame < minFrame) minFrame = frame;
+		if(frame > maxFrame) maxFrame = frame;
+		fprintf(timings, "%d,%d,%.2f\n", replay->frames - 1, steps, frame * 1e6);
+	}
+	if(timingsPath) fclose(timings);
+
+	int frames = replay->frames ? replay->frames : 1;
+	unsigned long long checksum = getWorldChecksum();
+	printf("replay: %s, %d frames, %d steps, %d threads, lanes: %d\n", path, replay->frames, replay->steps, threads, SAT_LANES);
+	printf("frame: %10.0f ns avg %10.0f ns min %10.0f ns max\n", total * 1e9 / frames, minFrame * 1e9, maxFrame * 1e9);
+	printf("checksum: %016llx\n", checksum);
+
+	int failed = 0;
+	if(!replay->complete) {
+		printf("the recording was not stopped, there is no checksum to compare with\n");
+	} else if(replay->frames != replay->recordedFrames || checksum != replay->recordedChecksum) {
+		printf("MISMATCH recorded %d frames with checksum %016llx\n", replay->recordedFrames, replay->recordedChecksum);
+		failed = 1;
+	} else {
+		printf("checksum matches the recording\n");
+	}
+	closePhysicsReplay(replay);
+	return failed;
+}
+
+static int settle(int boxes, int frames) {
+	createRigidBody(RIGID_FIXED, (Vector3) { 0, 1, 0 }, (Vector3) { 0.5f, 2, boxes * 0.5f + 1 });
+	BodyHandle *handles = xmalloc(sizeof(*handles) * (boxes ? boxes : 1));
+	Vector3 size = { 0.21f, 0.3f, 0.21f };
+	// two boxes per row, the second one pushes the first against the wall
+	for(int i = 0; i < boxes; i++) {
+		Vector3 pos = { -0.5f - (i % 2) * 0.3f, size.y / 2, (i / 2 - boxes / 4) * 0.5f };
+		handles[i] = createRigidBody(RIGID, pos, size);
+	}
+
+	int settled = -1;
+	for(int f = 0; f < frames; f++) {
+		for(int i = 0; i < boxes; i++) getRigidBody(handles[i])->vel = (Vector3) { BOX_SPEED, 0, 0 };
+		updateWorld(FRAME_TIME);
+		int sleeping = getPhysicsStats().sleepingBodies;
+		if(sleeping == boxes && settled < 0) settled = f;
+		else if(sleeping < boxes) settled = -1;
+	}
+	free(handles);
+
+	PhysicsStats last = getPhysicsStats();
+	printf("settle: %d boxes pushed against a wall, %d frames\n", boxes, frames);
+	if(settled < 0) {
+		printf("FAILED %d boxes of %d asleep after the last frame\n", last.sleepingBodies, boxes);
+		return 1;
+	}
+	printf("all asleep from frame %d\n", settled);
+	return 0;
+}
+
+/* Creates a pile of 'height' 1 m boxes standing on the ground at 'x', from the bottom box up
+ * or from the top box down, storing their handles from the bottom one in 'handles' */
+static void createPile(BodyHandle *handles, int height, float x, int bottomUp) {
+	for(int k = 0; k < height; k++) {
+		int i = bottomUp ? k : height - 1 - k;
+		handles[i] = createRigidBody(RIGID, (Vector3) { x, i + 0.5f, 0 }, (Vector3) { 1, 1, 1 });
+	}
+}
+
+static int stack(int height, int frames) {
+	createRigidBody(RIGID_FIXED, (Vector3) { 0, -0.5f, 0 }, (Vector3) { 10, 1, 10 });
+	BodyHandle *piles[2];
+	for(int p = 0; p < 2; p++) {
+		piles[p] = xmalloc(sizeof(*piles[p]) * (height ? height : 1));
+		createPile(piles[p], height, p * 3 - 1.5f, p == 0);
+	}
+	for(int f = 0; f < frames; f++) updateWorld(FRAME_TIME);
+
+	printf("stack: 2 piles of %d boxes, %d frames\n", height, frames);
+	int failed = 0;
+	for(int p = 0; p < 2; p++) {
+		// the worst error of the pile is the most a box got into the floor or into the box below
+		float sunk = 0;
+		int sleeping = 0;
+		for(int i = 0; i < height; i++) {
+			RigidBody *r = getRigidBody(piles[p][i]);
+			float error = i + 0.5f - r->pos.y;
+			if(error > sunk) sunk = error;
+			sleeping += r->sleeping;
+		}
+		int ok = sunk < 0.01f && sleeping == height;
+		printf("%-9s: sunk %.3f m, %d of %d asleep, %s\n", p == 0 ? "bottom up" : "top down",
+				sunk, sleeping, height, ok ? "ok" : "FAILED");
+		failed |= !ok;
+		free(piles[p]);
+	}
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	if(argc > 2 && strcmp(argv[1], "replay") == 0)
+		return replay(argv[2], argc > 3 ? atoi(argv[3]) : 1, argc > 4 ? argv[4] : NULL);
+	if(argc > 1 && strcmp(argv[1], "settle") == 0)
+		return settle(argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? atoi(argv[3]) : 120);
+	if(argc > 1 && strcmp(argv[1], "stack") == 0)
+		return stack(argc > 2 ? atoi(argv[2]) : 2, argc > 3 ? atoi(argv[3]) : 600);
+
+	// a recording takes the two first arguments, the others follow
+	const char *program = argv[0];
+	const char *recordingPath = NULL;
+	if(argc > 2 && strcmp(argv[1], "record") == 0) {
+		recordingPath = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	int boxes   = argc > 1 ? atoi(argv[1]) : 1000;
+	int bridges = argc > 2 ? atoi(argv[2]) : 4;
+	int trees   = argc > 3 ? atoi(argv[3]) : 30;
+	int frames  = argc > 4 ? atoi(argv[4]) : 600;
+	int threads = argc > 5 ? atoi(argv[5]) : 1;
+	int moving  = argc > 6 ? atoi(argv[6]) : 100;
+	const char *tracePath = argc > 7 ? argv[7] : NULL;
+	if(boxes < 0 || bridges < 0 || trees < 0 || frames < 1 || threads < 1 || moving < 0 || moving > 100) {
+		fprintf(stderr, "usage: %s [record <recording>] [boxes] [bridges] [trees] [frames] [threads] [moving %%] [trace file]\n"
+						"       %s replay <recording> [threads] [timings file]\n", program, program);
+		return 1;
+	}
+	srand(42);
+	setPhysicsThreads(threads);
+
+	Mesh bridge = loadObjCollisionMesh("res/objs/bridge.obj");
+	Mesh tree = loadObjCollisionMesh("res/objs/tree.obj");
+
+	// the scene grows with the number of bodies so the density stays about the same
+	float side = 2 * sqrtf(boxes + 4 * trees + 40 * bridges) + 10;
+	for(int i = 0; i < bridges; i++) placeStatic(&bridge, randomFloat(-side, side) / 2, randomFloat(-side, side) / 2);
+	for(int i = 0; i < trees; i++)   placeStatic(&tree,   randomFloat(-side, side) / 2, randomFloat(-side, side) / 2);
+	// the collision meshes are built here, not in the first step measured
+	buildCollisionMeshes();
+
+	BodyHandle *handles = xmalloc(sizeof(*handles) * (boxes ? boxes : 1));
+	float *headings = xmalloc(sizeof(*headings) * (boxes ? boxes : 1));
+	Vector3 size = { 0.21f, 0.3f, 0.21f };
+	for(int i = 0; i < boxes; i++) {
+		Vector3 pos = { randomFloat(-side, side) / 2, size.y / 2, randomFloat(-side, side) / 2 };
+		handles[i] = createRigidBody(RIGID, pos, size);
+		headings[i] = randomFloat(0, 2 * PI);
+	}
+
+	if(recordingPath && !startPhysicsRecording(recordingPath)) return 1;
+
+	long pairs = 0, trianglesVisited = 0, trianglesInMeshes = 0, contactCacheHits = 0;
+	double integrateTime = 0, collideTime = 0, resolveTime = 0;
+	double minStep = 1e9, maxStep = 0, total = 0;
+	for(int f = 0; f < frames; f++) {
+		// the first 'moving' percent of the boxes wander around, the others stand still
+		for(int i = 0; i < boxes * moving / 100; i++) {
+			RigidBody *r = getRigidBody(handles[i]);
+			headings[i] += randomFloat(-0.1f, 0.1f);
+			r->vel.x = sinf(headings[i]) * BOX_SPEED;
+			r->vel.z = cosf(headings[i]) * BOX_SPEED;
+		}
+
+		double start = now();
+		updateWorld(FRAME_TIME);
+		double step = now() - start;
+
+		total += step;
+		if(step < minStep) minStep = step;
+		if(step > maxStep) maxStep = step;
+		PhysicsStats stats = getPhysicsStats();
+		pairs += stats.pairs;
+		trianglesVisited += stats.trianglesVisited;
+		trianglesInMeshes += stats.trianglesInMeshes;
+		contactCacheHits += stats.contactCacheHits;
+		integrateTime += stats.integrateTime;
+		collideTime += stats.collideTime;
+		resolveTime += stats.resolveTime;
+	}
+
+	stopPhysicsRecording();
+
+	PhysicsStats last = getPhysicsStats();
+	printf("scene: %d boxes, %d bridges (%d triangles), %d trees (%d triangles), %.0fm side, %d threads\n",
+			boxes, bridges, bridge.triangleCount, trees, tree.triangleCount, side, threads);
+	printf("frames: %d, lanes: %d\n", frames, SAT_LANES);
+	printf("step: %10.0f ns avg %10.0f ns min %10.0f ns max\n", total * 1e9 / frames, minStep * 1e9, maxStep * 1e9);
+	printf("integrate: %10.0f ns collide: %10.0f ns resolve: %10.0f ns\n",
+			integrateTime * 1e9 / frames, collideTime * 1e9 / frames, resolveTime * 1e9 / frames);
+	printf("pairs per frame: %.1f, contact cache hits per frame: %.1f\n", (double)pairs / frames, (double)contactCacheHits / frames);
+	printf("triangles tested per frame: %.1f (of %.1f in the meshes queried)\n",
+			(double)trianglesVisited / frames, (double)trianglesInMeshes / frames);
+	printf("last frame: %d sleeping, %d islands, %d swept\n", last.sleepingBodies, last.islands, last.sweptBodies);
+	printf("checksum: %016llx\n", getWorldChecksum());
+
+	if(tracePath) {
+		FILE *f = fopen(tracePath, "w");
+		if(f == NULL) {
+			fprintf(stderr, "ERROR cannot write %s\n", tracePath);
+			exit(1);
+		}
+		size_t length = strlen(tracePath);
+		if(length > 5 && strcmp(tracePath + length - 5, ".json") == 0) writePhysicsTraceJSON(f);
+		else writePhysicsTraceCSV(f);
+		fclose(f);
+	}
+
+	free(handles);
+	free(headings);
+	free(bridge.vertices);
+	free(tree.vertices);
+	return 0;
+}
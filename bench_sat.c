@@ -0,0 +1,102 @@
+#include "physics.h"
+#include "utils.h"
+#include "raylib/src/raymath.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Microbenchmark of the box vs triangles SAT kernel. It checks that the SIMD kernel gives the
+ * same results of the scalar one on random boxes and triangles, then it times both of them */
+
+#define TRIANGLES 8192
+#define BOXES 2048
+#define ROUNDS 5
+
+static float randomFloat(float min, float max) {
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Runs the kernel 'sat' on every leaf sized group of triangles for every box and returns
+ * the number of overlapping triangles found */
+static long runKernel(int (*sat)(Box*, CollisionMesh*, int, int, float*, int*), Box *boxes, CollisionMesh *cm) {
+	long hits = 0;
+	float faceLength[SAT_LANES];
+	for(int b = 0; b < BOXES; b++) {
+		for(int t = 0; t < cm->triangleCount; t += SAT_LANES) {
+			int count = cm->triangleCount - t < SAT_LANES ? cm->triangleCount - t : SAT_LANES;
+			hits += __builtin_popcount(sat(&boxes[b], cm, t, count, faceLength, NULL));
+		}
+	}
+	return hits;
+}
+
+int main(void) {
+	srand(42);
+
+	// random small triangles scattered in a 4m cube
+	Mesh mesh = { 0 };
+	mesh.vertexCount = TRIANGLES * 3;
+	mesh.vertices = xmalloc(sizeof(float) * mesh.vertexCount * 3);
+	for(int t = 0; t < TRIANGLES; t++) {
+		Vector3 c = { randomFloat(-2, 2), randomFloat(-2, 2), randomFloat(-2, 2) };
+		for(int k = 0; k < 9; k++)
+			mesh.vertices[t * 9 + k] = (&c.x)[k % 3] + randomFloat(-0.3f, 0.3f);
+	}
+	CollisionMesh *cm = createCollisionMesh(&mesh, 1);
+
+	Box *boxes = xmalloc(sizeof(*boxes) * BOXES);
+	for(int b = 0; b < BOXES; b++) {
+		Vector3 size = { randomFloat(0.1f, 0.6f), randomFloat(0.1f, 0.6f), randomFloat(0.1f, 0.6f) };
+		Vector3 pos  = { randomFloat(-2, 2), randomFloat(-2, 2), randomFloat(-2, 2) };
+		boxes[b] = createBox(Vector3Scale(size, -0.5f), Vector3Scale(size, 0.5f), pos);
+	}
+
+	// validation
+	long mismatches = 0;
+	float simdLength[SAT_LANES], scalarLength[SAT_LANES];
+	int simdEarlyOuts[SAT_AXES] = { 0 }, scalarEarlyOuts[SAT_AXES] = { 0 };
+	for(int b = 0; b < BOXES; b++) {
+		for(int t = 0; t < cm->triangleCount; t += SAT_LANES) {
+			int count = cm->triangleCount - t < SAT_LANES ? cm->triangleCount - t : SAT_LANES;
+			int simdMask   = satBoxTriangles(&boxes[b], cm, t, count, simdLength, simdEarlyOuts);
+			int scalarMask = satBoxTrianglesScalar(&boxes[b], cm, t, count, scalarLength, scalarEarlyOuts);
+			if(simdMask != scalarMask) {
+				mismatches++;
+				continue;
+			}
+			for(int i = 0; i < count; i++)
+				if((simdMask & (1 << i)) && memcmp(&simdLength[i], &scalarLength[i], sizeof(float)))
+					mismatches++;
+		}
+	}
+
+	// both kernels must also agree on the axis that separated each triangle
+	if(memcmp(simdEarlyOuts, scalarEarlyOuts, sizeof(simdEarlyOuts))) mismatches++;
+
+	long tests = (long)BOXES * TRIANGLES * ROUNDS;
+	long hits = 0;
+	double start = now();
+	for(int r = 0; r < ROUNDS; r++) hits = runKernel(satBoxTrianglesScalar, boxes, cm);
+	double scalarTime = now() - start;
+
+	start = now();
+	for(int r = 0; r < ROUNDS; r++) hits = runKernel(satBoxTriangles, boxes, cm);
+	double simdTime = now() - start;
+
+	printf("lanes: %d, box-triangle tests: %ld, overlaps per round: %ld\n", SAT_LANES, tests, hits);
+	printf("mismatches: %ld\n", mismatches);
+	printf("scalar: %8.2f ns per triangle\n", scalarTime * 1e9 / tests);
+	printf("kernel: %8.2f ns per triangle (%.2fx)\n", simdTime * 1e9 / tests, scalarTime / simdTime);
+
+	freeCollisionMesh(cm);
+	free(boxes);
+	free(mesh.vertices);
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+#include "jobs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The pool is a set of threads waiting for a new job generation. The calling thread publishes
+ * the job, wakes the workers and runs the first range itself, then waits for the others */
+typedef struct WorkerPool {
+	pthread_t threads[MAX_WORKERS];
+	int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int pending;
+	int stopping;
+	JobFunction job;
+	void *data;
+	int items;
+} WorkerPool;
+
+static WorkerPool pool = {
+	.count = 1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done  = PTHREAD_COND_INITIALIZER
+};
+
+static void runRange(int worker) {
+	int chunk = (pool.items + pool.count - 1) / pool.count;
+	int first = worker * chunk;
+	int count = pool.items - first < chunk ? pool.items - first : chunk;
+	if(count > 0) pool.job(pool.data, worker, first, count);
+}
+
+static void *workerMain(void *arg) {
+	int worker = (int)(long)arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	for(;;) {
+		while(pool.generation == seen && !pool.stopping)
+			pthread_cond_wait(&pool.start, &pool.mutex);
+		if(pool.stopping) break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.mutex);
+
+		runRange(worker);
+
+		pthread_mutex_lock(&pool.mutex);
+		if(--pool.pending == 0) pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+	return NULL;
+}
+
+void startWorkers(int count) {
+	if(count < 1) count = 1;
+	if(count > MAX_WORKERS) count = MAX_WORKERS;
+	stopWorkers();
+
+	pool.stopping = 0;
+	pool.generation = 0;
+	for(int i = 1; i < count; i++) {
+		if(pthread_create(&pool.threads[i], NULL, workerMain, (void*)(long)i)) {
+			fprintf(stderr, "ERROR unable to start worker thread %d\n", i);
+			exit(1);
+		}
+	}
+	pool.count = count;
+}
+
+void stopWorkers(void) {
+	pthread_mutex_lock(&pool.mutex);
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for(int i = 1; i < pool.count; i++) pthread_join(pool.threads[i], NULL);
+	pool.count = 1;
+}
+
+int getWorkerCount(void) {
+	return pool.count;
+}
+
+void runParallel(JobFunction job, void *data, int items) {
+	pool.job = job;
+	pool.data = data;
+	pool.items = items;
+	if(pool.count == 1) {
+		runRange(0);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.pending = pool.count - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+
+	runRange(0);
+
+	pthread_mutex_lock(&pool.mutex);
+	while(pool.pending > 0) pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+}
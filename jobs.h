@@ -0,0 +1,25 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+/* maximum number of threads running a parallel job, the calling thread included */
+#define MAX_WORKERS 64
+
+/* A JobFunction processes 'count' items starting from 'first', 'worker' is the index of the thread
+ * running it (0 is the calling thread) and 'data' is the pointer passed to runParallel */
+typedef void (*JobFunction)(void *data, int worker, int first, int count);
+
+/* Starts the worker pool so that parallel jobs run on 'count' threads, the calling thread included.
+ * Calling it again resizes the pool */
+void startWorkers(int count);
+
+/* Stops the worker threads, parallel jobs run on the calling thread only after this call */
+void stopWorkers(void);
+
+/* Returns the number of threads running parallel jobs, the calling thread included */
+int getWorkerCount(void);
+
+/* Splits 'items' in one contiguous range per worker, worker i gets the i-th range, and runs 'job'
+ * on every range in parallel. It returns when all the ranges have been processed */
+void runParallel(JobFunction job, void *data, int items);
+
+#endif
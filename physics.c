@@ -1,43 +1,133 @@
 #include "physics.h"
 #include "utils.h"
+#include "jobs.h"
 #include "raylib/src/raymath.h"
 #include <float.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__) && !defined(PHYSICS_SCALAR)
+#include <immintrin.h>
+#define SAT_SIMD
+typedef __m256 SatFloat;
+#define satLoad(p)     _mm256_loadu_ps(p)
+#define satLoadQ(p)    _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p))))
+#define satStore(p, a) _mm256_storeu_ps(p, a)
+#define satSet(x)      _mm256_set1_ps(x)
+#define satAdd         _mm256_add_ps
+#define satSub         _mm256_sub_ps
+#define satMul         _mm256_mul_ps
+#define satMin         _mm256_min_ps
+#define satMax         _mm256_max_ps
+#define satOr          _mm256_or_ps
+#define satAnd         _mm256_and_ps
+#define satLt(a, b)    _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define satGt(a, b)    _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define satEq(a, b)    _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define satMask        _mm256_movemask_ps
+#elif defined(__SSE2__) && !defined(PHYSICS_SCALAR)
+#include <emmintrin.h>
+#define SAT_SIMD
+typedef __m128 SatFloat;
+#define satLoad(p)     _mm_loadu_ps(p)
+#define satLoadQ(p)    _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(p)), _mm_setzero_si128()))
+#define satStore(p, a) _mm_storeu_ps(p, a)
+#define satSet(x)      _mm_set1_ps(x)
+#define satAdd         _mm_add_ps
+#define satSub         _mm_sub_ps
+#define satMul         _mm_mul_ps
+#define satMin         _mm_min_ps
+#define satMax         _mm_max_ps
+#define satOr          _mm_or_ps
+#define satAnd         _mm_and_ps
+#define satLt          _mm_cmplt_ps
+#define satGt          _mm_cmpgt_ps
+#define satEq          _mm_cmpeq_ps
+#define satMask        _mm_movemask_ps
+#endif
 
 /* =============== Structs Manipulation Functions ===============  */
 
-RigidBody *createRigidBody(BodyType type, Vector3 position, Vector3 size) {
-	if(world.bodyCount == world.maxBodies) {
-		fprintf(stderr, "ERROR can't add more bodies to the world\n");
-		exit(1);
+World world = {
+	.gravity = 2,
+	.freeSlot = -1,
+	.freeContactCache = -1
+};
+
+/* Adds an uninitialized body to the world storage, growing it if needed, and assigns it a slot */
+static RigidBody *allocRigidBody(void) {
+	if(world.bodyCount == world.bodyCapacity) {
+		world.bodyCapacity = world.bodyCapacity ? world.bodyCapacity * 2 : 64;
+		world.bodies = xrealloc(world.bodies, sizeof(*world.bodies) * world.bodyCapacity);
+	}
+
+	int slot = world.freeSlot;
+	if(slot >= 0) {
+		world.freeSlot = world.slots[slot].nextFree;
+	} else {
+		if(world.slotCount == world.slotCapacity) {
+			world.slotCapacity = world.slotCapacity ? world.slotCapacity * 2 : 64;
+			world.slots = xrealloc(world.slots, sizeof(*world.slots) * world.slotCapacity);
+		}
+		slot = world.slotCount++;
+		// generations start from 1 so the zero handle is never valid
+		world.slots[slot].generation = 1;
 	}
-	RigidBody *r = xmalloc(sizeof(*r));
+
+	int dense = world.bodyCount++;
+	world.slots[slot].dense = dense;
+	world.slots[slot].nextFree = -1;
+
+	RigidBody *r = &world.bodies[dense];
+	r->handle = (BodyHandle) { .index = slot, .generation = world.slots[slot].generation };
+	r->vel = (Vector3) { 0, 0, 0 };
+	r->shape = SHAPE_BOX;
+	r->mesh = NULL;
+	r->meshCount = 0;
+	r->collision = NULL;
+	r->deferredMesh = 0;
+	r->heightfield = NULL;
+	r->sleeping = 0;
+	r->sleepTimer = 0;
+	r->sleepVel = (Vector3) { 0, 0, 0 };
+	r->inBroadphase = 0;
+	r->queryStamp = 0;
+	r->contactCache = -1;
+	return r;
+}
+
+BodyHandle createRigidBody(BodyType type, Vector3 position, Vector3 size) {
+	RigidBody *r = allocRigidBody();
 
 	r->type = type;
 	r->pos = position;
+	r->prevPos = position;
 	Vector3 minSize = (Vector3) { -size.x / 2, -size.y / 2, -size.z / 2 };
 	Vector3 maxSize = (Vector3) {  size.x / 2,  size.y / 2,  size.z / 2 };
 	r->box = createBox(minSize, maxSize, position);
 	r->groundDistance = position.y;
 	r->grounded = 1;
 
-	world.bodies[world.bodyCount++] = r;
-	return r;
+	broadphaseInsert(r);
+	return r->handle;
 }
 
-RigidBody *createRigidBodyFromMesh(BodyType type, Mesh *mesh, int meshCount, Vector3 position) {
-	if(world.bodyCount == world.maxBodies) {
-		fprintf(stderr, "ERROR can't add more bodies to the world\n");
-		exit(1);
-	}
-	RigidBody *r = xmalloc(sizeof(*r));
+BodyHandle createRigidBodyFromMesh(BodyType type, Mesh *mesh, int meshCount, Vector3 position) {
+	RigidBody *r = allocRigidBody();
 
 	r->type = type;
+	r->shape = SHAPE_MESH;
 	r->mesh = mesh;
 	r->meshCount = meshCount;
 	r->pos = position;
+	r->prevPos = position;
 	r->groundDistance = position.y;
 	r->grounded = 1;
 
@@ -62,10 +152,454 @@ RigidBody *createRigidBodyFromMesh(BodyType type, Mesh *mesh, int meshCount, Vec
 	Vector3 maxSize = (Vector3) { maxX, maxY, maxZ };
 
 	r->box = createBox(minSize, maxSize, position);
+	// fixed bodies are often baked, their collision mesh may never be needed
+	if(type == RIGID_FIXED) {
+		r->deferredMesh = 1;
+		world.deferredMeshes++;
+	}
+	else r->collision = acquireCollisionMesh(mesh, meshCount);
 	
-	world.bodies[world.bodyCount++] = r;
+	broadphaseInsert(r);
 
-	return r;
+	return r->handle;
+}
+
+BodyHandle createRigidBodyFromHeightfield(Heightfield *hf, Vector3 position) {
+	if(hf == NULL) {
+		fprintf(stderr, "ERROR cannot create a rigid body from a NULL heightfield!\n");
+		exit(1);
+	}
+	RigidBody *r = allocRigidBody();
+
+	r->type = RIGID_FIXED;
+	r->shape = SHAPE_HEIGHTFIELD;
+	r->heightfield = hf;
+	r->pos = position;
+	r->prevPos = position;
+	r->groundDistance = position.y;
+	r->grounded = 1;
+
+	Vector3 minSize = (Vector3) { 0, hf->minHeight, 0 };
+	Vector3 maxSize = (Vector3) { hf->cols * hf->cellSize, hf->maxHeight, hf->rows * hf->cellSize };
+	r->box = createBox(minSize, maxSize, position);
+
+	broadphaseInsert(r);
+	return r->handle;
+}
+
+Heightfield *createHeightfield(int cols, int rows, float cellSize, float *heights) {
+	if(cols < 1 || rows < 1 || cellSize <= 0) {
+		fprintf(stderr, "ERROR invalid heightfield of %d x %d cells of size %f\n", cols, rows, cellSize);
+		exit(1);
+	}
+	Heightfield *hf = xmalloc(sizeof(*hf));
+	int count = (cols + 1) * (rows + 1);
+	hf->cols = cols;
+	hf->rows = rows;
+	hf->cellSize = cellSize;
+	hf->heights = xmalloc(sizeof(*hf->heights) * count);
+	memcpy(hf->heights, heights, sizeof(*hf->heights) * count);
+	hf->minHeight =  FLT_MAX;
+	hf->maxHeight = -FLT_MAX;
+	for(int i = 0; i < count; i++) {
+		if(heights[i] < hf->minHeight) hf->minHeight = heights[i];
+		if(heights[i] > hf->maxHeight) hf->maxHeight = heights[i];
+	}
+	return hf;
+}
+
+void freeHeightfield(Heightfield *hf) {
+	if(hf == NULL) return;
+	free(hf->heights);
+	free(hf);
+}
+
+/* Returns the height of 'hf' at the local point 'x', 'z' and stores the normal of the triangle
+ * under it in 'normal'. Only the cell under the point is read */
+static float heightfieldLocalHeight(Heightfield *hf, float x, float z, Vector3 *normal) {
+	float gx = Clamp(x / hf->cellSize, 0, hf->cols);
+	float gz = Clamp(z / hf->cellSize, 0, hf->rows);
+	int cx = gx < hf->cols ? (int)gx : hf->cols - 1;
+	int cz = gz < hf->rows ? (int)gz : hf->rows - 1;
+	float fx = gx - cx;
+	float fz = gz - cz;
+
+	float *row0 = &hf->heights[cz * (hf->cols + 1) + cx];
+	float *row1 = row0 + hf->cols + 1;
+	float h00 = row0[0], h10 = row0[1];
+	float h01 = row1[0], h11 = row1[1];
+
+	float height, dx, dz;
+	if(fx + fz <= 1) {
+		// triangle of the corner (x, z)
+		dx = h10 - h00;
+		dz = h01 - h00;
+		height = h00 + dx * fx + dz * fz;
+	} else {
+		// triangle of the corner (x + 1, z + 1)
+		dx = h11 - h01;
+		dz = h11 - h10;
+		height = h11 - dx * (1 - fx) - dz * (1 - fz);
+	}
+	if(normal) *normal = Vector3Normalize((Vector3) { -dx, hf->cellSize, -dz });
+	return height;
+}
+
+float getHeightfieldHeight(RigidBody *r, float x, float z) {
+	if(r == NULL || r->heightfield == NULL) {
+		fprintf(stderr, "ERROR cannot read the height of a body without heightfield!\n");
+		exit(1);
+	}
+	return heightfieldLocalHeight(r->heightfield, x - r->pos.x, z - r->pos.z, NULL) + r->pos.y;
+}
+
+Vector3 getHeightfieldNormal(RigidBody *r, float x, float z) {
+	if(r == NULL || r->heightfield == NULL) {
+		fprintf(stderr, "ERROR cannot read the normal of a body without heightfield!\n");
+		exit(1);
+	}
+	Vector3 normal;
+	heightfieldLocalHeight(r->heightfield, x - r->pos.x, z - r->pos.z, &normal);
+	return normal;
+}
+
+static int compareHandles(BodyHandle a, BodyHandle b) {
+	if(a.index != b.index) return a.index < b.index ? -1 : 1;
+	if(a.generation != b.generation) return a.generation < b.generation ? -1 : 1;
+	return 0;
+}
+
+RigidBody *getRigidBody(BodyHandle h) {
+	if(h.index < 0 || h.index >= world.slotCount) return NULL;
+	BodySlot *slot = &world.slots[h.index];
+	if(slot->generation != h.generation || slot->dense < 0) return NULL;
+	return &world.bodies[slot->dense];
+}
+
+/* BVHBuildItem holds a triangle and its bounds while the BVH is being built */
+typedef struct BVHBuildItem {
+	Vector3 min;
+	Vector3 max;
+	Vector3 centroid;
+	Vector3 v[3];
+	unsigned short q[9];
+} BVHBuildItem;
+
+static int compareCentroidX(const void *a, const void *b) {
+	float d = ((BVHBuildItem*)a)->centroid.x - ((BVHBuildItem*)b)->centroid.x;
+	return (d > 0) - (d < 0);
+}
+
+static int compareCentroidY(const void *a, const void *b) {
+	float d = ((BVHBuildItem*)a)->centroid.y - ((BVHBuildItem*)b)->centroid.y;
+	return (d > 0) - (d < 0);
+}
+
+static int compareCentroidZ(const void *a, const void *b) {
+	float d = ((BVHBuildItem*)a)->centroid.z - ((BVHBuildItem*)b)->centroid.z;
+	return (d > 0) - (d < 0);
+}
+
+/* Builds the node for the 'count' items starting from 'first' splitting them at the median
+ * of the largest centroid axis, so the depth of the tree stays logarithmic */
+static int buildBVHNode(MeshBVH *bvh, BVHBuildItem *items, int first, int count) {
+	int index = bvh->nodeCount++;
+	BVHNode *node = &bvh->nodes[index];
+
+	Vector3 min  = items[first].min,      max  = items[first].max;
+	Vector3 cMin = items[first].centroid, cMax = items[first].centroid;
+	for(int i = first + 1; i < first + count; i++) {
+		min  = Vector3Min(min,  items[i].min);
+		max  = Vector3Max(max,  items[i].max);
+		cMin = Vector3Min(cMin, items[i].centroid);
+		cMax = Vector3Max(cMax, items[i].centroid);
+	}
+	node->min = min;
+	node->max = max;
+
+	if(count <= BVH_LEAF_SIZE) {
+		node->first = first;
+		node->count = count;
+		node->right = -1;
+		return index;
+	}
+
+	Vector3 extent = Vector3Subtract(cMax, cMin);
+	if(extent.x >= extent.y && extent.x >= extent.z)
+		qsort(&items[first], count, sizeof(*items), compareCentroidX);
+	else if(extent.y >= extent.z)
+		qsort(&items[first], count, sizeof(*items), compareCentroidY);
+	else
+		qsort(&items[first], count, sizeof(*items), compareCentroidZ);
+
+	int leftCount = count / 2;
+	node->first = first;
+	node->count = 0;
+	buildBVHNode(bvh, items, first, leftCount);
+	int right = buildBVHNode(bvh, items, first + leftCount, count - leftCount);
+	node->right = right;
+	return index;
+}
+
+/* 40 float arrays: 3 normal, 3 centroid, 27 axes, 4 bounds and 3 height components,
+ * followed by the 9 arrays of the quantized vertices */
+#define COLLISION_FLOATS 40
+#define COLLISION_QUANTIZED 9
+
+/* largest quantized coordinate */
+#define QUANTIZED_MAX 65535
+
+/* Size in bytes of the 'data' block of a collision mesh of 'triangleCount' triangles */
+static size_t collisionDataSize(int triangleCount) {
+	return (size_t)(triangleCount + SAT_LANES) * (sizeof(float) * COLLISION_FLOATS + sizeof(unsigned short) * COLLISION_QUANTIZED);
+}
+
+/* Points the arrays of 'cm' into its 'data' block */
+static void setCollisionArrays(CollisionMesh *cm) {
+	int stride = cm->triangleCount + SAT_LANES;
+	float *next = cm->data;
+	for(int i = 0; i < 3;  i++, next += stride) cm->n[i]    = next;
+	for(int i = 0; i < 3;  i++, next += stride) cm->c[i]    = next;
+	for(int i = 0; i < 27; i++, next += stride) cm->axes[i] = next;
+	for(int i = 0; i < 4;  i++, next += stride) cm->xz[i]   = next;
+	for(int i = 0; i < 3;  i++, next += stride) cm->h[i]    = next;
+	unsigned short *q = (unsigned short*)next;
+	for(int i = 0; i < 9;  i++, q += stride)    cm->q[i]    = q;
+}
+
+/* Component 'c' of the vertex 'k' of the triangle 't' of 'cm' from its quantized value. SAT
+ * does the same operations on many triangles at once, so the vertices are the same there */
+static inline float dequantize(CollisionMesh *cm, int t, int k, int c) {
+	return (&cm->qMin.x)[c] + cm->q[k * 3 + c][t] * (&cm->qScale.x)[c];
+}
+
+static Vector3 triangleVertex(CollisionMesh *cm, int t, int k) {
+	return (Vector3) { dequantize(cm, t, k, 0), dequantize(cm, t, k, 1), dequantize(cm, t, k, 2) };
+}
+
+static unsigned long long hashBytes(unsigned long long h, const void *data, size_t size) {
+	const unsigned char *bytes = data;
+	for(size_t i = 0; i < size; i++) {
+		h ^= bytes[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Hash of the triangles of 'meshes', the key of their collision mesh in the cache */
+static unsigned long long hashMeshes(Mesh *meshes, int meshCount) {
+	unsigned long long key = 14695981039346656037ULL;
+	for(int j = 0; j < meshCount; j++) {
+		Mesh *m = &meshes[j];
+		key = hashBytes(key, &m->vertexCount, sizeof(m->vertexCount));
+		key = hashBytes(key, m->vertices, sizeof(float) * 3 * m->vertexCount);
+		if(m->indices) key = hashBytes(key, m->indices, sizeof(*m->indices) * 3 * m->triangleCount);
+	}
+	return key;
+}
+
+/* Counts the vertices and the indices of 'meshes' */
+static void countMeshSources(Mesh *meshes, int meshCount, int *vertices, int *indices) {
+	*vertices = *indices = 0;
+	for(int j = 0; j < meshCount; j++) {
+		*vertices += meshes[j].vertexCount;
+		if(meshes[j].indices) *indices += meshes[j].triangleCount * 3;
+	}
+}
+
+/* box axes as set by createBox for every box */
+static const Vector3 boxAxes[3] = { { 0, 0, 1 }, { 1, 0, 0 }, { 0, 1, 0 } };
+
+/* Computes everything SAT and the ground probes need about the triangle 't' of 'cm' from its
+ * quantized vertices */
+static void setTriangleData(CollisionMesh *cm, int t) {
+	Vector3 v[3] = { triangleVertex(cm, t, 0), triangleVertex(cm, t, 1), triangleVertex(cm, t, 2) };
+	Vector3 min = Vector3Min(Vector3Min(v[0], v[1]), v[2]);
+	Vector3 max = Vector3Max(Vector3Max(v[0], v[1]), v[2]);
+	Vector3 centroid = Vector3Scale(Vector3Add(Vector3Add(v[0], v[1]), v[2]), 1.0f/3.0f);
+	Vector3 e[3] = {
+		Vector3Subtract(v[1], v[0]),
+		Vector3Subtract(v[2], v[1]),
+		Vector3Subtract(v[0], v[2])
+	};
+	Vector3 n = vectorProductNormalized(e[0], e[1]);
+
+	cm->n[0][t] = n.x;
+	cm->n[1][t] = n.y;
+	cm->n[2][t] = n.z;
+	cm->c[0][t] = centroid.x;
+	cm->c[1][t] = centroid.y;
+	cm->c[2][t] = centroid.z;
+
+	for(int j = 0; j < 3; j++) {
+		for(int k = 0; k < 3; k++) {
+			// degenerate axes are stored as zero vectors and skipped by SAT
+			Vector3 axis = vectorProductNormalized(boxAxes[j], e[k]);
+			cm->axes[(j * 3 + k) * 3    ][t] = axis.x;
+			cm->axes[(j * 3 + k) * 3 + 1][t] = axis.y;
+			cm->axes[(j * 3 + k) * 3 + 2][t] = axis.z;
+		}
+	}
+
+	if(fabsf(n.y) > GROUND_PROBE_MIN_NORMAL) {
+		cm->xz[0][t] = min.x;
+		cm->xz[1][t] = max.x;
+		cm->xz[2][t] = min.z;
+		cm->xz[3][t] = max.z;
+		// plane n . p = n . v1 solved for y
+		cm->h[0][t] = -n.x / n.y;
+		cm->h[1][t] = -n.z / n.y;
+		cm->h[2][t] = dotProduct(n, v[0]) / n.y;
+	} else {
+		cm->xz[0][t] =  FLT_MAX;
+		cm->xz[1][t] = -FLT_MAX;
+		cm->xz[2][t] =  FLT_MAX;
+		cm->xz[3][t] = -FLT_MAX;
+	}
+}
+
+CollisionMesh *createCollisionMesh(Mesh *meshes, int meshCount) {
+	int triangleCount = 0;
+	for(int j = 0; j < meshCount; j++)
+		triangleCount += meshes[j].indices ? meshes[j].triangleCount : meshes[j].vertexCount / 3;
+	if(triangleCount == 0) return NULL;
+
+	BVHBuildItem *items = xmalloc(sizeof(*items) * triangleCount);
+	int t = 0;
+	for(int j = 0; j < meshCount; j++) {
+		Mesh *m = &meshes[j];
+		int count = m->indices ? m->triangleCount : m->vertexCount / 3;
+		for(int i = 0; i < count; i++) {
+			BVHBuildItem *item = &items[t++];
+			for(int k = 0; k < 3; k++) {
+				int vi = m->indices ? m->indices[i * 3 + k] : i * 3 + k;
+				float *vs = &m->vertices[vi * 3];
+				item->v[k] = (Vector3) { vs[0], vs[1], vs[2] };
+			}
+		}
+	}
+
+	CollisionMesh *cm = xmalloc(sizeof(*cm));
+	cm->triangleCount = triangleCount;
+	cm->mapped = NULL;
+	cm->mappedSize = 0;
+	cm->key = 0;
+	countMeshSources(meshes, meshCount, &cm->sourceVertices, &cm->sourceIndices);
+	cm->refs = 1;
+
+	// the vertices are snapped to the 16 bit grid over the bounds before anything is computed
+	Vector3 min = items[0].v[0], max = items[0].v[0];
+	for(int i = 0; i < triangleCount; i++) {
+		for(int k = 0; k < 3; k++) {
+			min = Vector3Min(min, items[i].v[k]);
+			max = Vector3Max(max, items[i].v[k]);
+		}
+	}
+	cm->qMin = min;
+	cm->qScale = Vector3Scale(Vector3Subtract(max, min), 1.0f / QUANTIZED_MAX);
+	for(int i = 0; i < triangleCount; i++) {
+		BVHBuildItem *item = &items[i];
+		for(int k = 0; k < 3; k++) {
+			for(int c = 0; c < 3; c++) {
+				float scale = (&cm->qScale.x)[c];
+				float q = scale > 0 ? roundf(((&item->v[k].x)[c] - (&min.x)[c]) / scale) : 0;
+				item->q[k * 3 + c] = (unsigned short)fminf(fmaxf(q, 0), QUANTIZED_MAX);
+				(&item->v[k].x)[c] = (&min.x)[c] + item->q[k * 3 + c] * scale;
+			}
+		}
+		item->min = Vector3Min(Vector3Min(item->v[0], item->v[1]), item->v[2]);
+		item->max = Vector3Max(Vector3Max(item->v[0], item->v[1]), item->v[2]);
+		item->centroid = Vector3Scale(Vector3Add(Vector3Add(item->v[0], item->v[1]), item->v[2]), 1.0f/3.0f);
+	}
+
+	cm->bvh.nodes = xmalloc(sizeof(*cm->bvh.nodes) * (2 * triangleCount - 1));
+	cm->bvh.nodeCount = 0;
+	buildBVHNode(&cm->bvh, items, 0, triangleCount);
+
+	cm->data = xmalloc(collisionDataSize(triangleCount));
+	memset(cm->data, 0, collisionDataSize(triangleCount));
+	setCollisionArrays(cm);
+
+	for(int i = 0; i < triangleCount; i++) {
+		for(int k = 0; k < 9; k++) cm->q[k][i] = items[i].q[k];
+		setTriangleData(cm, i);
+	}
+	free(items);
+
+	return cm;
+}
+
+/* Tells if 'cm' was made from triangles with the counts and the bounds of the ones of 'meshes',
+ * so two sources whose hashes collide don't share a mesh */
+static int sameMeshSource(CollisionMesh *cm, Mesh *meshes, int meshCount) {
+	int vertices, indices;
+	countMeshSources(meshes, meshCount, &vertices, &indices);
+	if(vertices != cm->sourceVertices || indices != cm->sourceIndices) return 0;
+
+	// the bounds are computed like createCollisionMesh does, so they give the same grid
+	Vector3 min = { FLT_MAX, FLT_MAX, FLT_MAX }, max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for(int j = 0; j < meshCount; j++) {
+		Mesh *m = &meshes[j];
+		int count = m->indices ? m->triangleCount * 3 : m->vertexCount / 3 * 3;
+		for(int i = 0; i < count; i++) {
+			float *vs = &m->vertices[(m->indices ? m->indices[i] : i) * 3];
+			Vector3 v = { vs[0], vs[1], vs[2] };
+			min = Vector3Min(min, v);
+			max = Vector3Max(max, v);
+		}
+	}
+	Vector3 scale = Vector3Scale(Vector3Subtract(max, min), 1.0f / QUANTIZED_MAX);
+	return memcmp(&min, &cm->qMin, sizeof(min)) == 0 && memcmp(&scale, &cm->qScale, sizeof(scale)) == 0;
+}
+
+CollisionMesh *acquireCollisionMesh(Mesh *meshes, int meshCount) {
+	unsigned long long key = hashMeshes(meshes, meshCount);
+	for(int i = 0; i < world.meshCacheCount; i++) {
+		CollisionMesh *cm = world.meshCache[i];
+		if(cm->key != key || !sameMeshSource(cm, meshes, meshCount)) continue;
+		cm->refs++;
+		return cm;
+	}
+
+	CollisionMesh *cm = createCollisionMesh(meshes, meshCount);
+	if(cm == NULL) return NULL;
+	cm->key = key;
+	if(world.meshCacheCount == world.meshCacheCapacity) {
+		world.meshCacheCapacity = world.meshCacheCapacity ? world.meshCacheCapacity * 2 : 16;
+		world.meshCache = xrealloc(world.meshCache, sizeof(*world.meshCache) * world.meshCacheCapacity);
+	}
+	world.meshCache[world.meshCacheCount++] = cm;
+	return cm;
+}
+
+void freeCollisionMesh(CollisionMesh *cm) {
+	if(cm == NULL) return;
+	if(--cm->refs > 0) return;
+	for(int i = 0; i < world.meshCacheCount; i++) {
+		if(world.meshCache[i] != cm) continue;
+		world.meshCache[i] = world.meshCache[--world.meshCacheCount];
+		break;
+	}
+	if(cm->mapped) {
+		munmap(cm->mapped, cm->mappedSize);
+	} else {
+		free(cm->bvh.nodes);
+		free(cm->data);
+	}
+	free(cm);
+}
+
+/* Builds the collision mesh of 'r' if it was deferred */
+static void buildDeferredMesh(RigidBody *r) {
+	if(!r->deferredMesh) return;
+	r->deferredMesh = 0;
+	world.deferredMeshes--;
+	r->collision = acquireCollisionMesh(r->mesh, r->meshCount);
+}
+
+void buildCollisionMeshes(void) {
+	if(world.deferredMeshes == 0) return;
+	for(int i = 0; i < world.bodyCount; i++) buildDeferredMesh(&world.bodies[i]);
 }
 
 Box createBox(Vector3 minSize, Vector3 maxSize, Vector3 pos) {
@@ -109,20 +643,475 @@ Box createBox(Vector3 minSize, Vector3 maxSize, Vector3 pos) {
 }
 
 
-void freeRigidBody(RigidBody *r) {
+static void wakeOverlapping(RigidBody *r);
+static void releaseContactCaches(RigidBody *r);
+
+void freeRigidBody(BodyHandle h) {
+	RigidBody *r = getRigidBody(h);
 	if(r == NULL) {
-		fprintf(stderr, "ERROR trying to free an invalid pointer\n");
+		fprintf(stderr, "ERROR trying to free an invalid body handle\n");
 		exit(1);
 	}
-	free(r);
-	// TODO add real world bodies handling while freeing
+	// the bodies resting on this one have to fall
+	wakeOverlapping(r);
+	broadphaseRemove(r);
+	releaseContactCaches(r);
+	freeCollisionMesh(r->collision);
+	if(r->deferredMesh) world.deferredMeshes--;
+	freeHeightfield(r->heightfield);
+
+	// the last body takes the place of the freed one
+	BodySlot *slot = &world.slots[h.index];
+	int last = world.bodyCount - 1;
+	if(slot->dense != last) {
+		world.bodies[slot->dense] = world.bodies[last];
+		world.slots[world.bodies[slot->dense].handle.index].dense = slot->dense;
+	}
 	world.bodyCount--;
+
+	slot->dense = -1;
+	slot->generation++;
+	slot->nextFree = world.freeSlot;
+	world.freeSlot = h.index;
 }
 
 void updateRigidBodyPosition(RigidBody *r, Vector3 pos) {
 	r->pos = pos;
 	for(int i = 0; i < 8; i++) r->box.vw[i] = Vector3Add(r->box.v[i], pos);
 	r->box.wCenter = Vector3Add(r->box.center, r->pos);
+	broadphaseUpdate(r);
+}
+
+/* ============= Static World Functions =============  */
+
+/* StaticWorldHeader starts a static world cache file, it is followed by the BVH nodes and
+ * then by the data block of the collision mesh */
+typedef struct StaticWorldHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned long long key;
+	int triangleCount;
+	int nodeCount;
+	int lanes;
+	int nodeSize;
+	Vector3 qMin;
+	Vector3 qScale;
+} StaticWorldHeader;
+
+static const char staticWorldMagic[4] = { 'P', 'S', 'W', 'C' };
+
+static size_t staticWorldFileSize(int triangleCount, int nodeCount) {
+	return sizeof(StaticWorldHeader) + sizeof(BVHNode) * nodeCount + collisionDataSize(triangleCount);
+}
+
+/* Maps the cache at 'path' if it was written for 'key' and 'triangleCount' triangles, it returns
+ * NULL if there is no valid cache */
+static CollisionMesh *loadStaticWorld(const char *path, unsigned long long key, int triangleCount) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(StaticWorldHeader)) {
+		close(fd);
+		return NULL;
+	}
+	void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapped == MAP_FAILED) return NULL;
+
+	StaticWorldHeader *header = mapped;
+	if(memcmp(header->magic, staticWorldMagic, 4) || header->version != STATIC_WORLD_VERSION ||
+	   header->key != key || header->triangleCount != triangleCount || header->lanes != SAT_LANES || header->nodeSize != sizeof(BVHNode) ||
+	   (size_t)st.st_size != staticWorldFileSize(header->triangleCount, header->nodeCount)) {
+		munmap(mapped, st.st_size);
+		return NULL;
+	}
+
+	CollisionMesh *cm = xmalloc(sizeof(*cm));
+	cm->triangleCount = header->triangleCount;
+	cm->bvh.nodeCount = header->nodeCount;
+	cm->bvh.nodes = (BVHNode*)(header + 1);
+	cm->data = (float*)(cm->bvh.nodes + cm->bvh.nodeCount);
+	cm->qMin = header->qMin;
+	cm->qScale = header->qScale;
+	cm->mapped = mapped;
+	cm->mappedSize = st.st_size;
+	cm->key = key;
+	cm->sourceVertices = triangleCount * 3;
+	cm->sourceIndices = 0;
+	cm->refs = 1;
+	setCollisionArrays(cm);
+	return cm;
+}
+
+static void writeStaticWorld(const char *path, unsigned long long key, CollisionMesh *cm) {
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR cannot write the static world cache %s\n", path);
+		return;
+	}
+	StaticWorldHeader header = {
+		.version = STATIC_WORLD_VERSION,
+		.key = key,
+		.triangleCount = cm->triangleCount,
+		.nodeCount = cm->bvh.nodeCount,
+		.lanes = SAT_LANES,
+		.nodeSize = sizeof(BVHNode),
+		.qMin = cm->qMin,
+		.qScale = cm->qScale
+	};
+	memcpy(header.magic, staticWorldMagic, 4);
+	int written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+				  fwrite(cm->bvh.nodes, sizeof(BVHNode), cm->bvh.nodeCount, f) == (size_t)cm->bvh.nodeCount &&
+				  fwrite(cm->data, collisionDataSize(cm->triangleCount), 1, f) == 1;
+	if(fclose(f) != 0 || !written) {
+		fprintf(stderr, "ERROR cannot write the static world cache %s\n", path);
+		remove(path);
+	}
+}
+
+/* Tells if 'r' is merged by bakeStaticWorld */
+static int bakedInStaticWorld(RigidBody *r) {
+	return r->type == RIGID_FIXED && r->shape == SHAPE_MESH && r->mesh != NULL && r->inBroadphase;
+}
+
+int bakeStaticWorld(const char *cachePath) {
+	if(getRigidBody(world.staticWorld) != NULL) {
+		fprintf(stderr, "ERROR the static world has already been baked\n");
+		exit(1);
+	}
+
+	/* the key covers the source meshes of the bodies and where they are, it is computed without
+	 * their collision meshes so none is built when the cache is valid */
+	unsigned long long key = 14695981039346656037ULL;
+	int triangleCount = 0;
+	// copies of a model share their meshes, they are hashed once
+	Mesh *hashed = NULL;
+	unsigned long long meshKey = 0;
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(!bakedInStaticWorld(r)) continue;
+		if(r->mesh != hashed) meshKey = hashMeshes(r->mesh, r->meshCount);
+		hashed = r->mesh;
+		key = hashBytes(key, &meshKey, sizeof(meshKey));
+		key = hashBytes(key, &r->pos, sizeof(r->pos));
+		for(int j = 0; j < r->meshCount; j++)
+			triangleCount += r->mesh[j].indices ? r->mesh[j].triangleCount : r->mesh[j].vertexCount / 3;
+	}
+	if(triangleCount == 0) return 0;
+
+	CollisionMesh *cm = cachePath ? loadStaticWorld(cachePath, key, triangleCount) : NULL;
+	int cached = cm != NULL;
+	if(!cached) {
+		// the source triangles are moved to world space and built as a single mesh
+		Mesh merged = { 0 };
+		merged.vertexCount = triangleCount * 3;
+		merged.vertices = xmalloc(sizeof(float) * 9 * triangleCount);
+		float *next = merged.vertices;
+		for(int i = 0; i < world.bodyCount; i++) {
+			RigidBody *r = &world.bodies[i];
+			if(!bakedInStaticWorld(r)) continue;
+			for(int j = 0; j < r->meshCount; j++) {
+				Mesh *m = &r->mesh[j];
+				int count = m->indices ? m->triangleCount * 3 : m->vertexCount / 3 * 3;
+				for(int v = 0; v < count; v++) {
+					float *vs = &m->vertices[(m->indices ? m->indices[v] : v) * 3];
+					*next++ = vs[0] + r->pos.x;
+					*next++ = vs[1] + r->pos.y;
+					*next++ = vs[2] + r->pos.z;
+				}
+			}
+		}
+		cm = createCollisionMesh(&merged, 1);
+		free(merged.vertices);
+		if(cachePath) writeStaticWorld(cachePath, key, cm);
+	}
+
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(!bakedInStaticWorld(r)) continue;
+		broadphaseRemove(r);
+		freeCollisionMesh(r->collision);
+		r->collision = NULL;
+		if(r->deferredMesh) world.deferredMeshes--;
+		r->deferredMesh = 0;
+	}
+
+	RigidBody *r = allocRigidBody();
+	r->type = RIGID_FIXED;
+	r->shape = SHAPE_MESH;
+	r->pos = (Vector3) { 0, 0, 0 };
+	r->prevPos = r->pos;
+	r->box = createBox(cm->bvh.nodes[0].min, cm->bvh.nodes[0].max, r->pos);
+	r->groundDistance = 0;
+	r->grounded = 1;
+	r->collision = cm;
+	world.staticWorld = r->handle;
+	return cached;
+}
+
+/* ============= Contact Cache Functions =============  */
+
+static void unlinkContactCache(int *link) {
+	int index = *link;
+	ContactCache *cache = &world.contactCaches[index];
+	*link = cache->next;
+	cache->next = world.freeContactCache;
+	world.freeContactCache = index;
+}
+
+/* Returns the contact cache of the pair of 'a' and the mesh 'b', a new empty one the first
+ * time the pair is found. The caches are only created and released between the steps, the
+ * narrowphase workers just fill the one of their pair */
+static int findContactCache(RigidBody *a, RigidBody *b) {
+	for(int i = a->contactCache; i >= 0; i = world.contactCaches[i].next) {
+		ContactCache *cache = &world.contactCaches[i];
+		if(cache->b.index != b->handle.index || cache->b.generation != b->handle.generation) continue;
+		cache->step = world.stats.step;
+		return i;
+	}
+
+	int index = world.freeContactCache;
+	if(index >= 0) {
+		world.freeContactCache = world.contactCaches[index].next;
+	} else {
+		if(world.contactCacheCount == world.contactCacheCapacity) {
+			world.contactCacheCapacity = world.contactCacheCapacity ? world.contactCacheCapacity * 2 : 64;
+			world.contactCaches = xrealloc(world.contactCaches, sizeof(*world.contactCaches) * world.contactCacheCapacity);
+		}
+		index = world.contactCacheCount++;
+		world.contactCaches[index] = (ContactCache) { .leaves = NULL, .leafCapacity = 0 };
+	}
+	// the leaves array of a released cache is kept for the next one
+	ContactCache *cache = &world.contactCaches[index];
+	cache->b = b->handle;
+	cache->mesh = NULL;
+	cache->leafCount = 0;
+	cache->step = world.stats.step;
+	cache->next = a->contactCache;
+	a->contactCache = index;
+	return index;
+}
+
+/* Releases the caches of the pairs the broadphase didn't find in this step */
+static void releaseStaleContactCaches(void) {
+	for(int i = 0; i < world.bodyCount; i++) {
+		int *link = &world.bodies[i].contactCache;
+		while(*link >= 0) {
+			if(world.contactCaches[*link].step != world.stats.step) unlinkContactCache(link);
+			else link = &world.contactCaches[*link].next;
+		}
+	}
+}
+
+static void releaseContactCaches(RigidBody *r) {
+	while(r->contactCache >= 0) unlinkContactCache(&r->contactCache);
+}
+
+/* ============= Broadphase Functions =============  */
+
+static int cellCoord(float v) {
+	return (int)floorf(v / BROADPHASE_CELL_SIZE);
+}
+
+static CellRange computeCellRange(RigidBody *r) {
+	// vw[4] holds the min corner of the box and vw[2] the max corner
+	Vector3 min = r->box.vw[4];
+	Vector3 max = r->box.vw[2];
+	return (CellRange) {
+		.minX = cellCoord(min.x), .minY = cellCoord(min.y), .minZ = cellCoord(min.z),
+		.maxX = cellCoord(max.x), .maxY = cellCoord(max.y), .maxZ = cellCoord(max.z)
+	};
+}
+
+static RigidBody *slotBody(int slot) {
+	return &world.bodies[world.slots[slot].dense];
+}
+
+static BroadphaseBucket *cellBucket(int x, int y, int z) {
+	unsigned int h = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u;
+	return &world.broadphase.buckets[h & (BROADPHASE_BUCKETS - 1)];
+}
+
+static void bucketAdd(BroadphaseBucket *bucket, int slot) {
+	if(bucket->count == bucket->capacity) {
+		bucket->capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+		bucket->bodies = xrealloc(bucket->bodies, sizeof(*bucket->bodies) * bucket->capacity);
+	}
+	bucket->bodies[bucket->count++] = slot;
+}
+
+static void bucketRemove(BroadphaseBucket *bucket, int slot) {
+	for(int i = 0; i < bucket->count; i++) {
+		if(bucket->bodies[i] != slot) continue;
+		bucket->bodies[i] = bucket->bodies[--bucket->count];
+		return;
+	}
+}
+
+static void allocBroadphaseBuckets(void) {
+	Broadphase *bp = &world.broadphase;
+	if(bp->buckets != NULL) return;
+	bp->buckets = xmalloc(sizeof(*bp->buckets) * BROADPHASE_BUCKETS);
+	for(int i = 0; i < BROADPHASE_BUCKETS; i++)
+		bp->buckets[i] = (BroadphaseBucket) { .bodies = NULL, .count = 0, .capacity = 0 };
+}
+
+/* Grows the bounds of the broadphase to hold the cells 'c' */
+static void extendBroadphaseBounds(CellRange c) {
+	Broadphase *bp = &world.broadphase;
+	if(bp->occupied) {
+		CellRange *b = &bp->bounds;
+		c.minX = c.minX < b->minX ? c.minX : b->minX;
+		c.minY = c.minY < b->minY ? c.minY : b->minY;
+		c.minZ = c.minZ < b->minZ ? c.minZ : b->minZ;
+		c.maxX = c.maxX > b->maxX ? c.maxX : b->maxX;
+		c.maxY = c.maxY > b->maxY ? c.maxY : b->maxY;
+		c.maxZ = c.maxZ > b->maxZ ? c.maxZ : b->maxZ;
+	}
+	bp->bounds = c;
+	bp->occupied = 1;
+}
+
+void broadphaseInsert(RigidBody *r) {
+	allocBroadphaseBuckets();
+	CellRange c = computeCellRange(r);
+	extendBroadphaseBounds(c);
+	for(int x = c.minX; x <= c.maxX; x++)
+		for(int y = c.minY; y <= c.maxY; y++)
+			for(int z = c.minZ; z <= c.maxZ; z++)
+				bucketAdd(cellBucket(x, y, z), r->handle.index);
+	r->cells = c;
+	r->inBroadphase = 1;
+}
+
+void broadphaseRemove(RigidBody *r) {
+	if(!r->inBroadphase) return;
+	CellRange c = r->cells;
+	for(int x = c.minX; x <= c.maxX; x++)
+		for(int y = c.minY; y <= c.maxY; y++)
+			for(int z = c.minZ; z <= c.maxZ; z++)
+				bucketRemove(cellBucket(x, y, z), r->handle.index);
+	r->inBroadphase = 0;
+}
+
+void broadphaseUpdate(RigidBody *r) {
+	if(!r->inBroadphase) return;
+	CellRange c = computeCellRange(r);
+	CellRange o = r->cells;
+	if(c.minX == o.minX && c.minY == o.minY && c.minZ == o.minZ &&
+	   c.maxX == o.maxX && c.maxY == o.maxY && c.maxZ == o.maxZ) return;
+	broadphaseRemove(r);
+	broadphaseInsert(r);
+}
+
+static int boxesOverlap(Box *a, Box *b) {
+	return !(a->vw[2].x < b->vw[4].x || a->vw[4].x > b->vw[2].x ||
+			 a->vw[2].y < b->vw[4].y || a->vw[4].y > b->vw[2].y ||
+			 a->vw[2].z < b->vw[4].z || a->vw[4].z > b->vw[2].z);
+}
+
+/* Wakes up the RIGID bodies whose bounding box overlaps the one of 'r' */
+static void wakeOverlapping(RigidBody *r) {
+	if(!r->inBroadphase) return;
+	Broadphase *bp = &world.broadphase;
+	unsigned int stamp = ++bp->queryStamp;
+	r->queryStamp = stamp;
+	CellRange c = r->cells;
+	for(int x = c.minX; x <= c.maxX; x++)
+		for(int y = c.minY; y <= c.maxY; y++)
+			for(int z = c.minZ; z <= c.maxZ; z++) {
+				BroadphaseBucket *bucket = cellBucket(x, y, z);
+				for(int k = 0; k < bucket->count; k++) {
+					RigidBody *b = slotBody(bucket->bodies[k]);
+					if(b->queryStamp == stamp) continue;
+					b->queryStamp = stamp;
+					if(b->type == RIGID && boxesOverlap(&r->box, &b->box)) wakeRigidBody(b);
+				}
+			}
+}
+
+static void addOverlap(RigidBody *trigger, RigidBody *body) {
+	if(world.overlapCount == world.overlapCapacity) {
+		world.overlapCapacity = world.overlapCapacity ? world.overlapCapacity * 2 : 64;
+		world.overlaps = xrealloc(world.overlaps, sizeof(*world.overlaps) * world.overlapCapacity);
+	}
+	world.overlaps[world.overlapCount++] = (TriggerOverlap) { trigger->handle, body->handle };
+}
+
+/* Starts the overlaps of PHANTOM bodies of a new step, the ones of the last step become the
+ * previous ones. Sleeping bodies don't query the broadphase, they keep their overlaps */
+static void beginOverlaps(void) {
+	TriggerOverlap *temp = world.prevOverlaps;
+	world.prevOverlaps = world.overlaps;
+	world.overlaps = temp;
+	int capacity = world.prevOverlapCapacity;
+	world.prevOverlapCapacity = world.overlapCapacity;
+	world.overlapCapacity = capacity;
+	world.prevOverlapCount = world.overlapCount;
+	world.overlapCount = 0;
+
+	for(int i = 0; i < world.prevOverlapCount; i++) {
+		TriggerOverlap *o = &world.prevOverlaps[i];
+		RigidBody *trigger = getRigidBody(o->trigger);
+		RigidBody *body = getRigidBody(o->body);
+		if(trigger && body && body->sleeping) addOverlap(trigger, body);
+	}
+}
+
+static void addPair(RigidBody *a, RigidBody *b) {
+	Broadphase *bp = &world.broadphase;
+	if(bp->pairCount == bp->pairCapacity) {
+		bp->pairCapacity = bp->pairCapacity ? bp->pairCapacity * 2 : 64;
+		bp->pairs = xrealloc(bp->pairs, sizeof(*bp->pairs) * bp->pairCapacity);
+	}
+	int cache = b->shape == SHAPE_MESH && b->collision ? findContactCache(a, b) : -1;
+	bp->pairs[bp->pairCount++] = (BodyPair) { .a = a, .b = b, .contactCache = cache };
+}
+
+void broadphaseFindPairs(void) {
+	Broadphase *bp = &world.broadphase;
+	bp->pairCount = 0;
+	beginOverlaps();
+	if(bp->buckets == NULL) return;
+	RigidBody *staticWorld = getRigidBody(world.staticWorld);
+
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *a = &world.bodies[i];
+		if(a->type != RIGID || a->sleeping || !a->inBroadphase) continue;
+
+		if(staticWorld) {
+			if(boxesOverlap(&a->box, &staticWorld->box)) addPair(a, staticWorld);
+			else world.stats.aabbRejects++;
+		}
+
+		// each query gets a new stamp so bodies spanning many cells are visited once
+		unsigned int stamp = ++bp->queryStamp;
+		a->queryStamp = stamp;
+		CellRange c = a->cells;
+		for(int x = c.minX; x <= c.maxX; x++) {
+			for(int y = c.minY; y <= c.maxY; y++) {
+				for(int z = c.minZ; z <= c.maxZ; z++) {
+					BroadphaseBucket *bucket = cellBucket(x, y, z);
+					for(int k = 0; k < bucket->count; k++) {
+						RigidBody *b = slotBody(bucket->bodies[k]);
+						if(b->queryStamp == stamp) continue;
+						b->queryStamp = stamp;
+						/* pairs of RIGID bodies are reported by the body stored first,
+						 * unless the other one is sleeping and doesn't query */
+						if(b->type == RIGID && !b->sleeping && b < a) continue;
+						// phantoms are not resolved, they only report overlaps
+						if(b->type == PHANTOM) {
+							if(boxesOverlap(&a->box, &b->box)) addOverlap(b, a);
+							continue;
+						}
+						if(boxesOverlap(&a->box, &b->box)) addPair(a, b);
+						else world.stats.aabbRejects++;
+					}
+				}
+			}
+		}
+	}
+	releaseStaleContactCaches();
 }
 
 /* ============= Check Collision Functions =============  */
@@ -150,176 +1139,643 @@ CollisionInfo checkCollisionAABB(RigidBody *a, RigidBody *b) {
 	return i;
 }
 
-CollisionInfo checkCollision(RigidBody *a, RigidBody *b) {
-	if(a == NULL || b == NULL) {
-		fprintf(stderr, "ERROR cannot check for collision a NULL pointer to a RigidBody!\n");
-		exit(1);
-	}
-
-	CollisionInfo i = checkCollisionAABB(a, b);
-	if(i.baseLength < 0) return i;
-	/* TODO check if rigid body are complex shape or AABB
-	 * and use the appropriate collision detection algorithm */
-
-	// check collision using SAT
-	return collisionSATBoxAndComplexShape(a, b);
+/* Overlap of the intervals [aMin, aMax] and [bMin, bMax], negative if they are apart */
+static inline float intervalOverlap(float aMin, float aMax, float bMin, float bMax) {
+	return fminf(aMax, bMax) - fmaxf(aMin, bMin);
 }
 
-CollisionInfo collisionSATBoxAndComplexShape(RigidBody *a, RigidBody *b) {
-	Box *box = &(a->box);
-	Mesh *m = b->mesh;
+/* Box vs box, the boxes are axis aligned so their overlap on each world axis is all there is
+ * to know. The penetration is taken on the axis the boxes were still apart on before this step,
+ * or on the axis of the smallest overlap if there are more of them (or none), and goes along it
+ * from 'b' towards 'a'. The axis of the smallest overlap alone would push a small box that
+ * moved deep into a big one out from the side. If 'a' is above the top of 'b' with their
+ * footprints overlapping 'b' is also ground for 'a', and the other way around, since a pair of
+ * boxes is tested once whichever of them is above */
+static CollisionInfo boxAndBox(RigidBody *a, RigidBody *b, PhysicsStats *stats) {
 	CollisionInfo info;
 	info.baseLength = -1;
 	info.length = -1;
-	Ray dv1 = {
-		.position = { box->vw[0].x, box->wCenter.y, box->vw[0].z },
-		.direction = (Vector3) { 0, -1, 0 }
+	info.groundDistance = a->groundDistance;
+	info.bGroundDistance = b->groundDistance;
+
+	Vector3 aMin = a->box.vw[4], aMax = a->box.vw[2];
+	Vector3 bMin = b->box.vw[4], bMax = b->box.vw[2];
+	float overlap[3] = {
+		intervalOverlap(aMin.x, aMax.x, bMin.x, bMax.x),
+		intervalOverlap(aMin.y, aMax.y, bMin.y, bMax.y),
+		intervalOverlap(aMin.z, aMax.z, bMin.z, bMax.z)
 	};
-	Ray dv2 = {
-		.position = { box->vw[3].x, box->wCenter.y, box->vw[3].z },
-		.direction = (Vector3) { 0, -1, 0 }
-	};
-	Ray dv3 = {
-		.position = { box->vw[4].x, box->wCenter.y, box->vw[4].z },
-		.direction = (Vector3) { 0, -1, 0 }
-	};
-	Ray dv4 = {
-		.position = { box->vw[7].x, box->wCenter.y, box->vw[7].z },
-		.direction = (Vector3) { 0, -1, 0 }
+	if(overlap[0] < 0 || overlap[1] < 0 || overlap[2] < 0) {
+		stats->aabbRejects++;
+		return info;
+	}
+
+	if(overlap[0] > 0 && overlap[2] > 0 && bMax.y <= a->box.wCenter.y) {
+		float distance = a->box.wCenter.y - bMax.y;
+		if(distance < info.groundDistance) info.groundDistance = distance;
+	}
+	if(overlap[0] > 0 && overlap[2] > 0 && aMax.y <= b->box.wCenter.y) {
+		float distance = b->box.wCenter.y - aMax.y;
+		if(distance < info.bGroundDistance) info.bGroundDistance = distance;
+	}
+	if(overlap[0] == 0 || overlap[1] == 0 || overlap[2] == 0) return info; // only touching
+
+	// how much 'a' moved relative to 'b' in this step
+	Vector3 moved = Vector3Subtract(Vector3Subtract(a->pos, a->prevPos), Vector3Subtract(b->pos, b->prevPos));
+	float prevOverlap[3] = {
+		intervalOverlap(aMin.x - moved.x, aMax.x - moved.x, bMin.x, bMax.x),
+		intervalOverlap(aMin.y - moved.y, aMax.y - moved.y, bMin.y, bMax.y),
+		intervalOverlap(aMin.z - moved.z, aMax.z - moved.z, bMin.z, bMax.z)
 	};
-	Ray dv5 = {
-		.position = { box->wCenter.x, box->wCenter.y, box->wCenter.z },
-		.direction = (Vector3) { 0, -1, 0 }
+	int entered = (prevOverlap[0] <= 0) + (prevOverlap[1] <= 0) + (prevOverlap[2] <= 0);
+
+	// y first so a box standing on another one is pushed up on ties
+	int axis = -1;
+	int order[3] = { 1, 0, 2 };
+	for(int k = 0; k < 3; k++) {
+		int j = order[k];
+		if(entered == 1 && prevOverlap[j] > 0) continue;
+		if(axis < 0 || overlap[j] < overlap[axis]) axis = j;
+	}
+
+	Vector3 d = Vector3Subtract(a->box.wCenter, b->box.wCenter);
+	float side[3] = { d.x, d.y, d.z };
+	float direction[3] = { 0, 0, 0 };
+	direction[axis] = side[axis] < 0 ? -1 : 1;
+	info.length = overlap[axis];
+	info.direction = (Vector3) { direction[0], direction[1], direction[2] };
+	info.baseLength = info.length;
+	info.baseDirection = info.direction;
+	return info;
+}
+
+CollisionInfo collisionBoxAndBox(RigidBody *a, RigidBody *b) {
+	if(a == NULL || b == NULL) {
+		fprintf(stderr, "ERROR cannot check for collision a NULL pointer to a RigidBody!\n");
+		exit(1);
+	}
+	return boxAndBox(a, b, &world.stats);
+}
+
+static CollisionInfo satBoxAndMesh(RigidBody *a, RigidBody *b, ContactCache *cache, PhysicsStats *stats);
+static CollisionInfo boxAndHeightfield(RigidBody *a, RigidBody *b, PhysicsStats *stats);
+
+/* Narrowphase of a pair, like checkCollision but with the counters going to 'stats' and the
+ * contact cache of the pair 'cache', which can be NULL */
+static CollisionInfo narrowphase(RigidBody *a, RigidBody *b, ContactCache *cache, PhysicsStats *stats) {
+	// two boxes never need more than their bounds
+	if(b->shape == SHAPE_BOX) return boxAndBox(a, b, stats);
+
+	CollisionInfo i = checkCollisionAABB(a, b);
+	if(i.baseLength < 0) {
+		stats->aabbRejects++;
+		i.groundDistance = a->groundDistance;
+		i.bGroundDistance = b->groundDistance;
+		return i;
+	}
+
+	if(b->shape == SHAPE_HEIGHTFIELD) return boxAndHeightfield(a, b, stats);
+	// check collision using SAT
+	return satBoxAndMesh(a, b, cache, stats);
+}
+
+CollisionInfo checkCollision(RigidBody *a, RigidBody *b) {
+	if(a == NULL || b == NULL) {
+		fprintf(stderr, "ERROR cannot check for collision a NULL pointer to a RigidBody!\n");
+		exit(1);
+	}
+	buildDeferredMesh(b);
+	return narrowphase(a, b, NULL, &world.stats);
+}
+
+/* Tests the 'box' against the triangle 't' of 'cm' on the 13 SAT axes, it returns 1 if they
+ * overlap and stores in 'faceLength' the overlap length on the triangle normal.
+ * If they don't overlap the axis that separated them is counted in 'earlyOuts' (can be NULL) */
+static int satBoxTriangle(Box *box, CollisionMesh *cm, int t, float *faceLength, int *earlyOuts) {
+	Vector3 v1 = triangleVertex(cm, t, 0);
+	Vector3 v2 = triangleVertex(cm, t, 1);
+	Vector3 v3 = triangleVertex(cm, t, 2);
+
+	// check collision on triangle axis
+	Vector3 vN = (Vector3) { cm->n[0][t], cm->n[1][t], cm->n[2][t] };
+	*faceLength = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vN);
+	int axisIndex = 0;
+	if(!*faceLength) goto separated;
+	
+	// check collision on box axes and vector product between triangle sides and box axes
+	for(int j = 0; j < 3; j++) {
+		axisIndex++;
+		if(!checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, box->n[j])) goto separated;
+	
+		for(int k = 0; k < 3; k++) {
+			axisIndex++;
+			float **axis = &cm->axes[(j * 3 + k) * 3];
+			Vector3 vp = (Vector3) { axis[0][t], axis[1][t], axis[2][t] };
+			if(vp.x == 0 && vp.y == 0 && vp.z == 0) continue;
+			if(!checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vp)) goto separated;
+		}
+	}
+	return 1;
+
+separated:
+	if(earlyOuts) earlyOuts[axisIndex]++;
+	return 0;
+}
+
+int satBoxTrianglesScalar(Box *b, CollisionMesh *cm, int first, int count, float *faceLength, int *earlyOuts) {
+	int mask = 0;
+	for(int i = 0; i < count; i++)
+		if(satBoxTriangle(b, cm, first + i, &faceLength[i], earlyOuts)) mask |= 1 << i;
+	return mask;
+}
+
+#ifdef SAT_SIMD
+/* Projects the box 'b' and the triangles 'tv' on the axes 'nx', 'ny', 'nz', one axis per lane.
+ * It returns the mask of the lanes that overlap and stores the overlap length in 'length'.
+ * The operations are the same of checkOverlappingBoxAndTriangleOnAxis and in the same order,
+ * so the results are identical to the scalar path */
+static int satAxis(Box *b, SatFloat *tv, SatFloat nx, SatFloat ny, SatFloat nz, SatFloat *length) {
+	SatFloat sbMin = satSet(FLT_MAX);
+	SatFloat sbMax = satSet(-FLT_MAX);
+	for(int i = 0; i < 8; i++) {
+		SatFloat p = satAdd(satAdd(satMul(satSet(b->vw[i].x), nx), satMul(satSet(b->vw[i].y), ny)),
+							satMul(satSet(b->vw[i].z), nz));
+		sbMin = satMin(sbMin, p);
+		sbMax = satMax(sbMax, p);
+	}
+
+	SatFloat tMin = satAdd(satAdd(satMul(tv[0], nx), satMul(tv[1], ny)), satMul(tv[2], nz));
+	SatFloat tMax = tMin;
+	for(int k = 1; k < 3; k++) {
+		SatFloat p = satAdd(satAdd(satMul(tv[k * 3], nx), satMul(tv[k * 3 + 1], ny)), satMul(tv[k * 3 + 2], nz));
+		tMin = satMin(tMin, p);
+		tMax = satMax(tMax, p);
+	}
+
+	SatFloat separated = satOr(satLt(sbMax, tMin), satGt(sbMin, tMax));
+	*length = satMin(satSub(sbMax, tMin), satSub(tMax, sbMin));
+	// a zero overlap counts as separated, like in the scalar path
+	return ~satMask(satOr(separated, satEq(*length, satSet(0))));
+}
+
+/* Counts in 'earlyOuts' the lanes separated by the axis 'axisIndex', that were in 'before'
+ * and are not in 'active' anymore */
+static inline void countEarlyOuts(int *earlyOuts, int axisIndex, int before, int active) {
+	if(earlyOuts) earlyOuts[axisIndex] += __builtin_popcount(before & ~active);
+}
+
+int satBoxTriangles(Box *b, CollisionMesh *cm, int first, int count, float *faceLength, int *earlyOuts) {
+	int active = (1 << count) - 1;
+	int before = active;
+	int axisIndex = 0;
+	SatFloat zero = satSet(0);
+	SatFloat length;
+
+	SatFloat tv[9];
+	for(int i = 0; i < 9; i++)
+		tv[i] = satAdd(satSet((&cm->qMin.x)[i % 3]), satMul(satLoadQ(cm->q[i] + first), satSet((&cm->qScale.x)[i % 3])));
+
+	// check collision on triangle axis
+	active &= satAxis(b, tv, satLoad(cm->n[0] + first), satLoad(cm->n[1] + first), satLoad(cm->n[2] + first), &length);
+	satStore(faceLength, length);
+	countEarlyOuts(earlyOuts, axisIndex++, before, active);
+	if(!active) return 0;
+
+	// check collision on box axes and vector product between triangle sides and box axes
+	for(int j = 0; j < 3; j++) {
+		before = active;
+		active &= satAxis(b, tv, satSet(b->n[j].x), satSet(b->n[j].y), satSet(b->n[j].z), &length);
+		countEarlyOuts(earlyOuts, axisIndex++, before, active);
+		if(!active) return 0;
+
+		for(int k = 0; k < 3; k++) {
+			float **axis = &cm->axes[(j * 3 + k) * 3];
+			SatFloat nx = satLoad(axis[0] + first);
+			SatFloat ny = satLoad(axis[1] + first);
+			SatFloat nz = satLoad(axis[2] + first);
+			// degenerate axes are skipped
+			int degenerate = satMask(satAnd(satAnd(satEq(nx, zero), satEq(ny, zero)), satEq(nz, zero)));
+			before = active;
+			active &= satAxis(b, tv, nx, ny, nz, &length) | degenerate;
+			countEarlyOuts(earlyOuts, axisIndex++, before, active);
+			if(!active) return 0;
+		}
+	}
+	return active;
+}
+#else
+int satBoxTriangles(Box *b, CollisionMesh *cm, int first, int count, float *faceLength, int *earlyOuts) {
+	return satBoxTrianglesScalar(b, cm, first, count, faceLength, earlyOuts);
+}
+#endif
+
+/* Casts the vertical ground probes starting from the 'probes' origins against the triangles of
+ * a BVH leaf of 'cm' and updates 'groundDistance'. A probe hits a triangle if its origin
+ * is inside the triangle projection on the ground plane and above the triangle plane.
+ * 'footprint' is the min x, max x, min z and max z of the probes origins */
+static void groundProbesAndLeaf(float *groundDistance, Vector3 *probes, float *footprint, CollisionMesh *cm, BVHNode *leaf, PhysicsStats *stats) {
+	for(int t = leaf->first; t < leaf->first + leaf->count; t++) {
+		if(cm->xz[1][t] < footprint[0] || cm->xz[0][t] > footprint[1] ||
+		   cm->xz[3][t] < footprint[2] || cm->xz[2][t] > footprint[3]) continue;
+
+		float x1 = dequantize(cm, t, 0, 0), z1 = dequantize(cm, t, 0, 2);
+		float x2 = dequantize(cm, t, 1, 0), z2 = dequantize(cm, t, 1, 2);
+		float x3 = dequantize(cm, t, 2, 0), z3 = dequantize(cm, t, 2, 2);
+		for(int p = 0; p < GROUND_PROBES; p++) {
+			float px = probes[p].x, pz = probes[p].z;
+			if(px < cm->xz[0][t] || px > cm->xz[1][t] || pz < cm->xz[2][t] || pz > cm->xz[3][t]) continue;
+
+			// the probe is inside if it is on the same side of every edge
+			float w1 = (x2 - x1) * (pz - z1) - (z2 - z1) * (px - x1);
+			float w2 = (x3 - x2) * (pz - z2) - (z3 - z2) * (px - x2);
+			float w3 = (x1 - x3) * (pz - z3) - (z1 - z3) * (px - x3);
+			if(!((w1 >= 0 && w2 >= 0 && w3 >= 0) || (w1 <= 0 && w2 <= 0 && w3 <= 0))) continue;
+
+			float distance = probes[p].y - (cm->h[0][t] * px + cm->h[1][t] * pz + cm->h[2][t]);
+			if(distance <= 0) continue;
+			stats->groundProbeHits++;
+			if(distance < *groundDistance) *groundDistance = distance;
+		}
+	}
+}
+
+/* Tests the 'box' against the triangles of a BVH leaf of 'cm', both in the local space of the mesh,
+ * and stores the collision in 'info' if the penetration of a triangle is the smallest found so far */
+static void collisionBoxAndLeaf(Box *box, CollisionMesh *cm, BVHNode *leaf, CollisionInfo *info, PhysicsStats *stats) {
+	int first = leaf->first;
+
+	float faceLength[SAT_LANES];
+	int mask = satBoxTriangles(box, cm, first, leaf->count, faceLength, stats->satEarlyOuts);
+
+	for(int i = 0; mask; i++, mask >>= 1) {
+		if(!(mask & 1)) continue;
+		int t = first + i;
+		float collLength = faceLength[i];
+		Vector3 collAxis = (Vector3) { cm->n[0][t], cm->n[1][t], cm->n[2][t] };
+		Vector3 tCenter = (Vector3) { cm->c[0][t], cm->c[1][t], cm->c[2][t] };
+		Vector3 dir = Vector3Subtract(box->wCenter, tCenter);
+
+		if(dotProduct(dir, collAxis) > 0 && (info->length == -1 || info->length > collLength)) {
+			info->v1 = triangleVertex(cm, t, 0);
+			info->v2 = triangleVertex(cm, t, 1);
+			info->v3 = triangleVertex(cm, t, 2);
+			info->length = collLength;
+			info->direction = collAxis;
+		}
+	}
+}
+
+static int boundsOverlap(Vector3 aMin, Vector3 aMax, Vector3 bMin, Vector3 bMax) {
+	return !(aMax.x < bMin.x || aMin.x > bMax.x ||
+			 aMax.y < bMin.y || aMin.y > bMax.y ||
+			 aMax.z < bMin.z || aMin.z > bMax.z);
+}
+
+static int boundsInside(Vector3 aMin, Vector3 aMax, Vector3 bMin, Vector3 bMax) {
+	return aMin.x >= bMin.x && aMax.x <= bMax.x &&
+		   aMin.y >= bMin.y && aMax.y <= bMax.y &&
+		   aMin.z >= bMin.z && aMax.z <= bMax.z;
+}
+
+/* Box vs mesh SAT, it only reads the bodies so it can run on any worker, counters go to 'stats'.
+ * With a 'cache' the leaves are taken from it if the query region is still inside its region,
+ * otherwise the BVH is traversed over a grown region and the leaves found are cached. Either
+ * way the leaves overlapping the query region are tested in the same order */
+static CollisionInfo satBoxAndMesh(RigidBody *a, RigidBody *b, ContactCache *cache, PhysicsStats *stats) {
+	CollisionMesh *cm = b->collision;
+	CollisionInfo info;
+	info.baseLength = -1;
+	info.length = -1;
+	info.groundDistance = a->groundDistance;
+	info.bGroundDistance = b->groundDistance;
+	if(cm == NULL) return info;
+
+	/* the box is moved in the local space of 'b' once, so the triangles are read as stored */
+	Vector3 bP = b->pos;
+	Box box = a->box;
+	for(int i = 0; i < 8; i++) box.vw[i] = Vector3Subtract(box.vw[i], bP);
+	box.wCenter = Vector3Subtract(box.wCenter, bP);
+
+	/* the ground probes start from the height of the box center, below the box corners and center */
+	Vector3 probes[GROUND_PROBES] = {
+		{ box.vw[0].x,   box.wCenter.y, box.vw[0].z   },
+		{ box.vw[3].x,   box.wCenter.y, box.vw[3].z   },
+		{ box.vw[4].x,   box.wCenter.y, box.vw[4].z   },
+		{ box.vw[7].x,   box.wCenter.y, box.vw[7].z   },
+		{ box.wCenter.x, box.wCenter.y, box.wCenter.z }
 	};
-	// loop through all triangles
-	for(int j = 0; j < b->meshCount; j++) {
-		float *vs = m[j].vertices;
-		for(int i = 0; i < m[j].vertexCount; i += 3) {
-			Vector3 bP = b->pos;
-			Vector3 v1 = (Vector3){ vs[i*3+0] + bP.x, vs[i*3+1] + bP.y, vs[i*3+2] + bP.z };
-			Vector3 v2 = (Vector3){ vs[i*3+3] + bP.x, vs[i*3+4] + bP.y, vs[i*3+5] + bP.z };
-			Vector3 v3 = (Vector3){ vs[i*3+6] + bP.x, vs[i*3+7] + bP.y, vs[i*3+8] + bP.z };
-
-			/* checking distance from floor */
-			RayCollision rayCollision1 = GetRayCollisionTriangle(dv1, v1, v2, v3);
-			RayCollision rayCollision2 = GetRayCollisionTriangle(dv2, v1, v2, v3);
-			RayCollision rayCollision3 = GetRayCollisionTriangle(dv3, v1, v2, v3);
-			RayCollision rayCollision4 = GetRayCollisionTriangle(dv4, v1, v2, v3);
-			RayCollision rayCollision5 = GetRayCollisionTriangle(dv5, v1, v2, v3);
-			if(rayCollision1.hit) {
-				a->groundDistance = rayCollision1.distance < a->groundDistance ? 
-									  rayCollision1.distance : a->groundDistance;
-			}
-			if(rayCollision2.hit) {
-				a->groundDistance = rayCollision2.distance < a->groundDistance ? 
-									  rayCollision2.distance : a->groundDistance;
-			}
-			if(rayCollision3.hit) {
-				a->groundDistance = rayCollision3.distance < a->groundDistance ? 
-									  rayCollision3.distance : a->groundDistance;
-			}
-			if(rayCollision4.hit) {
-				a->groundDistance = rayCollision4.distance < a->groundDistance ? 
-									  rayCollision4.distance : a->groundDistance;
-			}
-			if(rayCollision5.hit) {
-				a->groundDistance = rayCollision5.distance < a->groundDistance ? 
-									  rayCollision5.distance : a->groundDistance;
+	float footprint[4] = { box.vw[4].x, box.vw[2].x, box.vw[4].z, box.vw[2].z };
+
+	/* the query region is the box extended downwards to the current ground distance,
+	 * which is as far as a probe hit can matter */
+	Vector3 qMin = box.vw[4];
+	Vector3 qMax = box.vw[2];
+	float probeBottom = box.wCenter.y - fmaxf(a->groundDistance, 0);
+	if(probeBottom < qMin.y) qMin.y = probeBottom;
+
+	stats->trianglesInMeshes += cm->triangleCount;
+
+	MeshBVH *bvh = &cm->bvh;
+	if(cache && cache->mesh == cm && boundsInside(qMin, qMax, cache->min, cache->max)) {
+		stats->contactCacheHits++;
+		for(int i = 0; i < cache->leafCount; i++) {
+			BVHNode *node = &bvh->nodes[cache->leaves[i]];
+			if(!boundsOverlap(node->min, node->max, qMin, qMax)) continue;
+			groundProbesAndLeaf(&info.groundDistance, probes, footprint, cm, node, stats);
+			collisionBoxAndLeaf(&box, cm, node, &info, stats);
+			stats->trianglesVisited += node->count;
+		}
+	} else {
+		Vector3 rMin = qMin, rMax = qMax;
+		if(cache) {
+			Vector3 margin = { CONTACT_CACHE_MARGIN, CONTACT_CACHE_MARGIN, CONTACT_CACHE_MARGIN };
+			rMin = Vector3Subtract(qMin, margin);
+			rMax = Vector3Add(qMax, margin);
+			cache->mesh = cm;
+			cache->min = rMin;
+			cache->max = rMax;
+			cache->leafCount = 0;
+		}
+
+		int stack[BVH_STACK_SIZE];
+		int top = 0;
+		stack[top++] = 0;
+		while(top > 0) {
+			int index = stack[--top];
+			BVHNode *node = &bvh->nodes[index];
+			if(!boundsOverlap(node->min, node->max, rMin, rMax)) continue;
+
+			if(node->count == 0) {
+				stack[top++] = node->right;
+				stack[top++] = index + 1;
+				continue;
 			}
-	
-			// triangle sides
-			Vector3 lt1 = Vector3Subtract(v2, v1);
-			Vector3 lt2 = Vector3Subtract(v3, v2);
-			Vector3 lt3 = Vector3Subtract(v1, v3);
-			// calculate the normal to the triangle
-			Vector3 vN = vectorProductNormalized(lt1, lt2);
-			// check collision on triangle axis
-			float collLength  = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vN);
-			Vector3 collAxis = vN;
-			if(!collLength) goto noCollisionFound;
-			
-			
-			// check collision on box axes and vector product between triangle sides and box axes
-			float tmpLength;
-			for(int j = 0; j < 3; j++) {
-				
-				tmpLength = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, box->n[j]);
-				if(!tmpLength) goto noCollisionFound;
-				//if(tmpLength < collLength) {
-				//	collLength = tmpLength;
-				//	collAxis = box->n[j];
-				//}
-			
-				Vector3 vp = vectorProductNormalized(box->n[j], lt1);
-				if(Vector3Length(vp) > 0.00001f) {
-					tmpLength = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vp);
-					if(!tmpLength) goto noCollisionFound;
-					//if(tmpLength < collLength) {
-					//	collLength = tmpLength;
-					//	collAxis = vp;
-					//}
-				}
-			
-				vp = vectorProductNormalized(box->n[j], lt2);
-				if(Vector3Length(vp) > 0.00001f) {
-					tmpLength = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vp);
-					if(!tmpLength) goto noCollisionFound;
-					//if(tmpLength < collLength) {
-					//	collLength = tmpLength;
-					//	collAxis = vp;
-					//}
-				}
-			
-				vp = vectorProductNormalized(box->n[j], lt3);
-				if(Vector3Length(vp) > 0.00001f) {
-					tmpLength = checkOverlappingBoxAndTriangleOnAxis(box, v1, v2, v3, vp);
-					if(!tmpLength) goto noCollisionFound;
-					//if(tmpLength < collLength) {
-					//	collLength = tmpLength;
-					//	collAxis = vp;
-					//}
+
+			if(cache) {
+				if(cache->leafCount == cache->leafCapacity) {
+					cache->leafCapacity = cache->leafCapacity ? cache->leafCapacity * 2 : 16;
+					cache->leaves = xrealloc(cache->leaves, sizeof(*cache->leaves) * cache->leafCapacity);
 				}
+				cache->leaves[cache->leafCount++] = index;
+				if(!boundsOverlap(node->min, node->max, qMin, qMax)) continue;
 			}
+			groundProbesAndLeaf(&info.groundDistance, probes, footprint, cm, node, stats);
+			collisionBoxAndLeaf(&box, cm, node, &info, stats);
+			stats->trianglesVisited += node->count;
+		}
+	}
 
-			
-			Vector3 tCenter = Vector3Scale(Vector3Add(Vector3Add(v1, v2), v3), 1.0f/3.0f);
-			Vector3 dir = Vector3Subtract(box->wCenter, tCenter);
+	if(info.length > 0) {
+		info.v1 = Vector3Add(info.v1, bP);
+		info.v2 = Vector3Add(info.v2, bP);
+		info.v3 = Vector3Add(info.v3, bP);
+	}
 
-			if(dotProduct(dir, collAxis) > 0 && (info.length == -1 || info.length > collLength)) {
-				info.v1 = v1;
-				info.v2 = v2;
-				info.v3 = v3;
-				info.length = collLength;
-				info.direction = collAxis;
-			}
+	return info;
+}
+
+CollisionInfo collisionSATBoxAndComplexShape(RigidBody *a, RigidBody *b) {
+	buildDeferredMesh(b);
+	return satBoxAndMesh(a, b, NULL, &world.stats);
+}
+
+/* Samples the heightfield at the local point 'x', 'z': it updates the ground distance of the
+ * box center at height 'centerY' and the deepest penetration of the box bottom 'bottom'.
+ * Only the samples of the ground probes pass 'stats', to count their hits */
+static void sampleHeightfield(Heightfield *hf, float x, float z, float centerY, float bottom,
+							  CollisionInfo *info, float *depth, PhysicsStats *stats) {
+	Vector3 normal;
+	float height = heightfieldLocalHeight(hf, x, z, &normal);
+	float distance = centerY - height;
+	if(distance > 0) {
+		if(stats) stats->groundProbeHits++;
+		if(distance < info->groundDistance) info->groundDistance = distance;
+	}
+	if(height - bottom > *depth) {
+		*depth = height - bottom;
+		info->direction = normal;
+	}
+}
+
+/* Samples the heightfield where the side of a footprint crosses the grid lines and the cell
+ * diagonals. The side goes from 'from' to 'to' along x if 'alongX' is set, along z otherwise,
+ * and 'fixed' is its other coordinate */
+static void sampleHeightfieldSide(Heightfield *hf, float from, float to, float fixed, int alongX,
+								  float centerY, float bottom, CollisionInfo *info, float *depth) {
+	float cs = hf->cellSize;
+	int lines = alongX ? hf->cols : hf->rows;
+	int first = (int)fmaxf(ceilf(from / cs), 0);
+	int last  = (int)fminf(floorf(to / cs), lines);
+	for(int i = first; i <= last; i++) {
+		float p = i * cs;
+		sampleHeightfield(hf, alongX ? p : fixed, alongX ? fixed : p, centerY, bottom, info, depth, NULL);
+	}
+	// the diagonals are the lines x + z = k * cellSize
+	first = (int)fmaxf(ceilf((from + fixed) / cs), 0);
+	last  = (int)fminf(floorf((to + fixed) / cs), hf->cols + hf->rows);
+	for(int k = first; k <= last; k++) {
+		float p = k * cs - fixed;
+		sampleHeightfield(hf, alongX ? p : fixed, alongX ? fixed : p, centerY, bottom, info, depth, NULL);
+	}
+}
+
+/* Box vs heightfield, only the cells under the footprint of the box are read. The terrain is
+ * flat inside a triangle, so its highest point under the footprint is at one of the footprint
+ * corners, at a grid corner inside the footprint or where the footprint sides cross the grid
+ * lines or the cell diagonals. The penetration found is returned as the length that moves the
+ * box up out of the terrain */
+static CollisionInfo boxAndHeightfield(RigidBody *a, RigidBody *b, PhysicsStats *stats) {
+	Heightfield *hf = b->heightfield;
+	CollisionInfo info;
+	info.baseLength = -1;
+	info.length = -1;
+	info.groundDistance = a->groundDistance;
+	info.bGroundDistance = b->groundDistance;
+
+	Vector3 min = Vector3Subtract(a->box.vw[4], b->pos);
+	Vector3 max = Vector3Subtract(a->box.vw[2], b->pos);
+	Vector3 center = Vector3Subtract(a->box.wCenter, b->pos);
+	float depth = 0;
+
+	// the same probes of the meshes, below the box corners and center
+	sampleHeightfield(hf, min.x,    min.z,    center.y, min.y, &info, &depth, stats);
+	sampleHeightfield(hf, max.x,    min.z,    center.y, min.y, &info, &depth, stats);
+	sampleHeightfield(hf, min.x,    max.z,    center.y, min.y, &info, &depth, stats);
+	sampleHeightfield(hf, max.x,    max.z,    center.y, min.y, &info, &depth, stats);
+	sampleHeightfield(hf, center.x, center.z, center.y, min.y, &info, &depth, stats);
+
+	sampleHeightfieldSide(hf, min.x, max.x, min.z, 1, center.y, min.y, &info, &depth);
+	sampleHeightfieldSide(hf, min.x, max.x, max.z, 1, center.y, min.y, &info, &depth);
+	sampleHeightfieldSide(hf, min.z, max.z, min.x, 0, center.y, min.y, &info, &depth);
+	sampleHeightfieldSide(hf, min.z, max.z, max.x, 0, center.y, min.y, &info, &depth);
+
+	float cs = hf->cellSize;
+	int x0 = (int)fmaxf(ceilf(min.x / cs), 0), x1 = (int)fminf(floorf(max.x / cs), hf->cols);
+	int z0 = (int)fmaxf(ceilf(min.z / cs), 0), z1 = (int)fminf(floorf(max.z / cs), hf->rows);
+	for(int x = x0; x <= x1; x++)
+		for(int z = z0; z <= z1; z++)
+			sampleHeightfield(hf, x * cs, z * cs, center.y, min.y, &info, &depth, NULL);
+
+	if(depth > 0) {
+		// handleCollision moves the box up by the vertical component of the length along the normal
+		info.length = depth / info.direction.y;
+		info.baseLength = info.length;
+		info.baseDirection = info.direction;
+	}
+	return info;
+}
+
+/* Moving SAT of 'box' against the triangle 't' of 'cm': on each axis the box moving by 'd'
+ * touches the triangle between two times, the box touches the triangle from the latest
+ * of the first times to the earliest of the last times. It returns the first time of contact
+ * in (0, 1] and the axis it happened on in 'normal', or -1 if they don't touch or already overlap */
+static float sweepBoxTriangle(Box *box, Vector3 d, CollisionMesh *cm, int t, Vector3 *normal) {
+	Vector3 tv[3] = { triangleVertex(cm, t, 0), triangleVertex(cm, t, 1), triangleVertex(cm, t, 2) };
+	Vector3 axes[13];
+	int axisCount = 0;
+	axes[axisCount++] = (Vector3) { cm->n[0][t], cm->n[1][t], cm->n[2][t] };
+	for(int j = 0; j < 3; j++) {
+		axes[axisCount++] = box->n[j];
+		for(int k = 0; k < 3; k++) {
+			float **axis = &cm->axes[(j * 3 + k) * 3];
+			Vector3 vp = (Vector3) { axis[0][t], axis[1][t], axis[2][t] };
+			if(vp.x == 0 && vp.y == 0 && vp.z == 0) continue;
+			axes[axisCount++] = vp;
+		}
+	}
+
+	float tFirst = -FLT_MAX;
+	float tLast = FLT_MAX;
+	for(int i = 0; i < axisCount; i++) {
+		Vector3 n = axes[i];
+		float bMin = FLT_MAX, bMax = -FLT_MAX;
+		for(int k = 0; k < 8; k++) {
+			float p = dotProduct(box->vw[k], n);
+			if(p < bMin) bMin = p;
+			if(p > bMax) bMax = p;
+		}
+		float tMin = FLT_MAX, tMax = -FLT_MAX;
+		for(int k = 0; k < 3; k++) {
+			float p = dotProduct(tv[k], n);
+			if(p < tMin) tMin = p;
+			if(p > tMax) tMax = p;
+		}
 
-			/*
-	   		printf("==================================\n");
-			printf("Colliding with triangle\n");
-			printf("V1 (%f, %f, %f)\n", v1.x, v1.y, v1.z);
-			printf("V2 (%f, %f, %f)\n", v2.x, v2.y, v2.z);
-			printf("V3 (%f, %f, %f)\n", v3.x, v3.y, v3.z);
-			printf("Collision direction\n");
-			printf("N (%f, %f, %f)\n", collAxis.x, collAxis.y, collAxis.z);
-			printf("Collision length\n");
-			printf("L %f\n", collLength);
-			printf("Center direction\n");
-			printf("D (%f, %f, %f)\n", dir.x, dir.y, dir.z);
-			printf("Dot Product\n");
-			printf("%f\n", dotProduct(dir, collAxis));
-			printf("Box center\n");
-			printf("B (%f, %f, %f)\n", box->wCenter.x, box->wCenter.y, box->wCenter.z);
-			printf("Tri center\n");
-			printf("T (%f, %f, %f)\n", tCenter.x, tCenter.y, tCenter.z);
-			printf("Ground distance: %f\n", info.groundDistance);
-			*/
-			
-			noCollisionFound: 
+		float v = dotProduct(d, n);
+		if(v == 0) {
+			// not moving on this axis, so they are separated forever or never
+			if(bMax < tMin || bMin > tMax) return -1;
 			continue;
 		}
+		float t0 = (tMin - bMax) / v;
+		float t1 = (tMax - bMin) / v;
+		if(t0 > t1) { float temp = t0; t0 = t1; t1 = temp; }
+		if(t0 > tFirst) {
+			tFirst = t0;
+			*normal = v > 0 ? Vector3Negate(n) : n;
+		}
+		if(t1 < tLast) tLast = t1;
+		if(tFirst > tLast || tFirst > 1 || tLast < 0) return -1;
 	}
+	return tFirst > 0 ? tFirst : -1;
+}
 
-	return info;
+/* Sweeps 'box' by 'd' against the walls of 'b', the box must be in world space. It lowers 'toi'
+ * to the first time of contact found and stores the wall normal in 'normal' */
+static void sweepBoxAndMesh(Box *box, Vector3 d, RigidBody *b, float *toi, Vector3 *normal) {
+	CollisionMesh *cm = b->collision;
+	Vector3 bP = b->pos;
+	Box local = *box;
+	for(int i = 0; i < 8; i++) local.vw[i] = Vector3Subtract(local.vw[i], bP);
+
+	Vector3 qMin = Vector3Min(local.vw[4], Vector3Add(local.vw[4], d));
+	Vector3 qMax = Vector3Max(local.vw[2], Vector3Add(local.vw[2], d));
+
+	MeshBVH *bvh = &cm->bvh;
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while(top > 0) {
+		int index = stack[--top];
+		BVHNode *node = &bvh->nodes[index];
+		if(!boundsOverlap(node->min, node->max, qMin, qMax)) continue;
+
+		if(node->count == 0) {
+			stack[top++] = node->right;
+			stack[top++] = index + 1;
+			continue;
+		}
+
+		for(int t = node->first; t < node->first + node->count; t++) {
+			// floors and slopes are left to the ground probes, only walls stop the sweep
+			if(fabsf(cm->n[1][t]) >= maxSlope) continue;
+			Vector3 n;
+			float time = sweepBoxTriangle(&local, d, cm, t, &n);
+			if(time < 0 || time >= *toi) continue;
+			*toi = time;
+			*normal = n;
+		}
+	}
+}
+
+float sweepRigidBody(RigidBody *r, Vector3 displacement, Vector3 *normal) {
+	if(r == NULL) {
+		fprintf(stderr, "ERROR cannot sweep a NULL pointer to a RigidBody!\n");
+		exit(1);
+	}
+	buildCollisionMeshes();
+	float toi = 1;
+	*normal = (Vector3) { 0, 0, 0 };
+	Broadphase *bp = &world.broadphase;
+	if(bp->buckets == NULL) return toi;
+
+	// the static bodies are found in the cells covered by the whole movement
+	Vector3 min = Vector3Min(r->box.vw[4], Vector3Add(r->box.vw[4], displacement));
+	Vector3 max = Vector3Max(r->box.vw[2], Vector3Add(r->box.vw[2], displacement));
+	RigidBody *staticWorld = getRigidBody(world.staticWorld);
+	if(staticWorld && boundsOverlap(staticWorld->box.vw[4], staticWorld->box.vw[2], min, max))
+		sweepBoxAndMesh(&r->box, displacement, staticWorld, &toi, normal);
+	unsigned int stamp = ++bp->queryStamp;
+	r->queryStamp = stamp;
+	for(int x = cellCoord(min.x); x <= cellCoord(max.x); x++) {
+		for(int y = cellCoord(min.y); y <= cellCoord(max.y); y++) {
+			for(int z = cellCoord(min.z); z <= cellCoord(max.z); z++) {
+				BroadphaseBucket *bucket = cellBucket(x, y, z);
+				for(int k = 0; k < bucket->count; k++) {
+					RigidBody *b = slotBody(bucket->bodies[k]);
+					if(b->queryStamp == stamp) continue;
+					b->queryStamp = stamp;
+					if(b->type != RIGID_FIXED || b->collision == NULL) continue;
+					if(!boundsOverlap(b->box.vw[4], b->box.vw[2], min, max)) continue;
+					sweepBoxAndMesh(&r->box, displacement, b, &toi, normal);
+				}
+			}
+		}
+	}
+	return toi;
+}
+
+/* Moves 'r' by 'displacement' without passing through walls: at each hit the body stops just
+ * before the wall and the rest of the movement slides along it. After SWEEP_ITERATIONS hits,
+ * e.g. in a corner, the body stops before the next wall and the rest of the movement is lost */
+static void moveSwept(RigidBody *r, Vector3 displacement) {
+	for(int i = 0; i <= SWEEP_ITERATIONS; i++) {
+		float length = Vector3Length(displacement);
+		if(length == 0) return;
+		Vector3 n;
+		float toi = sweepRigidBody(r, displacement, &n);
+		if(toi >= 1) {
+			updateRigidBodyPosition(r, Vector3Add(r->pos, displacement));
+			return;
+		}
+
+		float t = fmaxf(toi - SWEEP_SKIN / length, 0);
+		updateRigidBodyPosition(r, Vector3Add(r->pos, Vector3Scale(displacement, t)));
+		displacement = Vector3Scale(displacement, 1 - t);
+		n = Vector3Normalize(n);
+		float into = dotProduct(displacement, n);
+		if(into < 0) displacement = Vector3Subtract(displacement, Vector3Scale(n, into));
+	}
 }
 
 float checkOverlappingBoxAndTriangleOnAxis(Box *b, Vector3 v1, Vector3 v2, Vector3 v3, Vector3 n) {
@@ -395,17 +1851,530 @@ float checkOverlappingBoxBaseAndTriangleOnAxis(Box *b, Vector3 v1, Vector3 v2, V
 	return d1 > d2 ? d2 : d1;
 }
 
+/* ============= Query Functions =============  */
+
+/* Tells if the query 'q' considers the body 'r' */
+static int queryAccepts(PhysicsQuery *q, RigidBody *r) {
+	int types = q->types ? q->types : (1 << RIGID) | (1 << RIGID_FIXED);
+	if(!(types & (1 << r->type))) return 0;
+	if(q->shapes && !(q->shapes & (1 << r->shape))) return 0;
+	return compareHandles(r->handle, q->ignore) != 0;
+}
+
+/* Clips the ray 'o' + t * 'd' to the bounds 'min', 'max', narrowing [t0, t1] to the part inside
+ * them. It returns 0 if the ray misses them, the axis the ray enters from goes in 'axis' */
+static int clipRay(Vector3 o, Vector3 d, Vector3 min, Vector3 max, float *t0, float *t1, int *axis) {
+	float *po = &o.x, *pd = &d.x, *pMin = &min.x, *pMax = &max.x;
+	for(int i = 0; i < 3; i++) {
+		if(pd[i] == 0) {
+			if(po[i] < pMin[i] || po[i] > pMax[i]) return 0;
+			continue;
+		}
+		float a = (pMin[i] - po[i]) / pd[i];
+		float b = (pMax[i] - po[i]) / pd[i];
+		if(a > b) { float temp = a; a = b; b = temp; }
+		if(a > *t0) {
+			*t0 = a;
+			if(axis) *axis = i;
+		}
+		if(b < *t1) *t1 = b;
+		if(*t0 > *t1) return 0;
+	}
+	return 1;
+}
+
+/* Returns where the ray 'o' + t * 'd' crosses the triangle 'v1', 'v2', 'v3' from either side,
+ * -1 if it doesn't */
+static float rayTriangle(Vector3 o, Vector3 d, Vector3 v1, Vector3 v2, Vector3 v3) {
+	Vector3 e1 = Vector3Subtract(v2, v1);
+	Vector3 e2 = Vector3Subtract(v3, v1);
+	Vector3 p = vectorProduct(d, e2);
+	float det = dotProduct(e1, p);
+	if(fabsf(det) < 1e-12f) return -1;
+	float inverse = 1 / det;
+	Vector3 s = Vector3Subtract(o, v1);
+	float u = dotProduct(s, p) * inverse;
+	if(u < 0 || u > 1) return -1;
+	Vector3 q = vectorProduct(s, e1);
+	float v = dotProduct(d, q) * inverse;
+	if(v < 0 || u + v > 1) return -1;
+	float t = dotProduct(e2, q) * inverse;
+	return t >= 0 ? t : -1;
+}
+
+/* Normal of the triangle 'v1', 'v2', 'v3' on the side the ray along 'd' comes from */
+static Vector3 facingNormal(Vector3 d, Vector3 v1, Vector3 v2, Vector3 v3) {
+	Vector3 n = vectorProductNormalized(Vector3Subtract(v2, v1), Vector3Subtract(v3, v1));
+	return dotProduct(n, d) > 0 ? Vector3Negate(n) : n;
+}
+
+/* Point of the triangle 'a', 'b', 'c' closest to 'p', found from the region of the triangle
+ * 'p' projects into: a vertex, a side or the face */
+static Vector3 closestPointOnTriangle(Vector3 p, Vector3 a, Vector3 b, Vector3 c) {
+	Vector3 ab = Vector3Subtract(b, a);
+	Vector3 ac = Vector3Subtract(c, a);
+	Vector3 ap = Vector3Subtract(p, a);
+	float d1 = dotProduct(ab, ap), d2 = dotProduct(ac, ap);
+	if(d1 <= 0 && d2 <= 0) return a;
+
+	Vector3 bp = Vector3Subtract(p, b);
+	float d3 = dotProduct(ab, bp), d4 = dotProduct(ac, bp);
+	if(d3 >= 0 && d4 <= d3) return b;
+	float vc = d1 * d4 - d3 * d2;
+	if(vc <= 0 && d1 >= 0 && d3 <= 0) return Vector3Add(a, Vector3Scale(ab, d1 / (d1 - d3)));
+
+	Vector3 cp = Vector3Subtract(p, c);
+	float d5 = dotProduct(ab, cp), d6 = dotProduct(ac, cp);
+	if(d6 >= 0 && d5 <= d6) return c;
+	float vb = d5 * d2 - d1 * d6;
+	if(vb <= 0 && d2 >= 0 && d6 <= 0) return Vector3Add(a, Vector3Scale(ac, d2 / (d2 - d6)));
+
+	float va = d3 * d6 - d5 * d4;
+	if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+		return Vector3Add(b, Vector3Scale(Vector3Subtract(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6))));
+
+	float denom = 1 / (va + vb + vc);
+	return Vector3Add(a, Vector3Add(Vector3Scale(ab, vb * denom), Vector3Scale(ac, vc * denom)));
+}
+
+static int sphereTriangle(Vector3 center, float radius, Vector3 v1, Vector3 v2, Vector3 v3) {
+	Vector3 d = Vector3Subtract(center, closestPointOnTriangle(center, v1, v2, v3));
+	return dotProduct(d, d) <= radius * radius;
+}
+
+/* Stores in 'v' the 6 vertices of the two triangles of the cell 'cx', 'cz' of 'hf', in local space */
+static void heightfieldCellTriangles(Heightfield *hf, int cx, int cz, Vector3 *v) {
+	float cs = hf->cellSize;
+	float *row0 = &hf->heights[cz * (hf->cols + 1) + cx];
+	float *row1 = row0 + hf->cols + 1;
+	Vector3 p00 = { cx * cs,       row0[0], cz * cs       };
+	Vector3 p10 = { (cx + 1) * cs, row0[1], cz * cs       };
+	Vector3 p01 = { cx * cs,       row1[0], (cz + 1) * cs };
+	Vector3 p11 = { (cx + 1) * cs, row1[1], (cz + 1) * cs };
+	v[0] = p00; v[1] = p10; v[2] = p01;
+	v[3] = p10; v[4] = p11; v[5] = p01;
+}
+
+/* Ray against the triangles of 'cm' through its BVH, 'o' is in the local space of the mesh.
+ * Only hits before 'best' count, it returns the nearest one or -1 */
+static float rayMesh(CollisionMesh *cm, Vector3 o, Vector3 d, float best, Vector3 *normal) {
+	float hit = -1;
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while(top > 0) {
+		int index = stack[--top];
+		BVHNode *node = &cm->bvh.nodes[index];
+		float t0 = 0, t1 = best;
+		if(!clipRay(o, d, node->min, node->max, &t0, &t1, NULL)) continue;
+
+		if(node->count == 0) {
+			stack[top++] = node->right;
+			stack[top++] = index + 1;
+			continue;
+		}
+		for(int t = node->first; t < node->first + node->count; t++) {
+			Vector3 v1 = triangleVertex(cm, t, 0);
+			Vector3 v2 = triangleVertex(cm, t, 1);
+			Vector3 v3 = triangleVertex(cm, t, 2);
+			float tHit = rayTriangle(o, d, v1, v2, v3);
+			if(tHit < 0 || tHit >= best) continue;
+			best = tHit;
+			hit = tHit;
+			*normal = facingNormal(d, v1, v2, v3);
+		}
+	}
+	return hit;
+}
+
+/* Ray against the triangles of 'hf', 'o' is in the local space of the heightfield. The cells
+ * are walked in the order the ray crosses them on the xz plane, so the first hit is the nearest */
+static float rayHeightfield(Heightfield *hf, Vector3 o, Vector3 d, float best, Vector3 *normal) {
+	float cs = hf->cellSize;
+	float t0 = 0, t1 = best;
+	Vector3 min = { 0, hf->minHeight, 0 };
+	Vector3 max = { hf->cols * cs, hf->maxHeight, hf->rows * cs };
+	if(!clipRay(o, d, min, max, &t0, &t1, NULL)) return -1;
+
+	Vector3 start = Vector3Add(o, Vector3Scale(d, t0));
+	int cx = (int)Clamp(floorf(start.x / cs), 0, hf->cols - 1);
+	int cz = (int)Clamp(floorf(start.z / cs), 0, hf->rows - 1);
+	int stepX = d.x > 0 ? 1 : -1;
+	int stepZ = d.z > 0 ? 1 : -1;
+	float nextX = d.x != 0 ? ((cx + (d.x > 0)) * cs - o.x) / d.x : FLT_MAX;
+	float nextZ = d.z != 0 ? ((cz + (d.z > 0)) * cs - o.z) / d.z : FLT_MAX;
+	float deltaX = d.x != 0 ? cs / fabsf(d.x) : FLT_MAX;
+	float deltaZ = d.z != 0 ? cs / fabsf(d.z) : FLT_MAX;
+
+	while(cx >= 0 && cx < hf->cols && cz >= 0 && cz < hf->rows) {
+		Vector3 v[6];
+		heightfieldCellTriangles(hf, cx, cz, v);
+		float hit = -1;
+		for(int k = 0; k < 6; k += 3) {
+			float tHit = rayTriangle(o, d, v[k], v[k + 1], v[k + 2]);
+			if(tHit < 0 || tHit >= best || (hit >= 0 && tHit >= hit)) continue;
+			hit = tHit;
+			*normal = facingNormal(d, v[k], v[k + 1], v[k + 2]);
+		}
+		if(hit >= 0) return hit;
+
+		float next = fminf(nextX, nextZ);
+		if(next > t1) break;
+		if(nextX < nextZ) {
+			cx += stepX;
+			nextX += deltaX;
+		} else {
+			cz += stepZ;
+			nextZ += deltaZ;
+		}
+	}
+	return -1;
+}
+
+/* Ray of 'q' against the body 'r', it returns where it hits before 'best' or -1 */
+static float rayBody(PhysicsQuery *q, RigidBody *r, float best, Vector3 *normal) {
+	float t0 = 0, t1 = best;
+	int axis = -1;
+	if(!clipRay(q->origin, q->direction, r->box.vw[4], r->box.vw[2], &t0, &t1, &axis)) return -1;
+
+	Vector3 o = Vector3Subtract(q->origin, r->pos);
+	if(r->shape == SHAPE_HEIGHTFIELD) return rayHeightfield(r->heightfield, o, q->direction, best, normal);
+	if(r->collision) return rayMesh(r->collision, o, q->direction, best, normal);
+
+	// a ray starting inside the box hits it right away
+	*normal = Vector3Negate(q->direction);
+	if(axis >= 0) {
+		float sign = (&q->direction.x)[axis] > 0 ? -1 : 1;
+		*normal = (Vector3) { axis == 0 ? sign : 0, axis == 1 ? sign : 0, axis == 2 ? sign : 0 };
+	}
+	return t0;
+}
+
+/* Box of 'q' against the triangles of 'cm' through its BVH, 'box' is in the local space of the mesh */
+static int boxOverlapsMesh(CollisionMesh *cm, Box *box) {
+	float faceLength[SAT_LANES];
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while(top > 0) {
+		int index = stack[--top];
+		BVHNode *node = &cm->bvh.nodes[index];
+		if(!boundsOverlap(node->min, node->max, box->vw[4], box->vw[2])) continue;
+
+		if(node->count == 0) {
+			stack[top++] = node->right;
+			stack[top++] = index + 1;
+			continue;
+		}
+		if(satBoxTriangles(box, cm, node->first, node->count, faceLength, NULL)) return 1;
+	}
+	return 0;
+}
+
+static int sphereOverlapsMesh(CollisionMesh *cm, Vector3 center, float radius) {
+	Vector3 extent = { radius, radius, radius };
+	Vector3 min = Vector3Subtract(center, extent);
+	Vector3 max = Vector3Add(center, extent);
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while(top > 0) {
+		int index = stack[--top];
+		BVHNode *node = &cm->bvh.nodes[index];
+		if(!boundsOverlap(node->min, node->max, min, max)) continue;
+
+		if(node->count == 0) {
+			stack[top++] = node->right;
+			stack[top++] = index + 1;
+			continue;
+		}
+		for(int t = node->first; t < node->first + node->count; t++)
+			if(sphereTriangle(center, radius, triangleVertex(cm, t, 0), triangleVertex(cm, t, 1), triangleVertex(cm, t, 2)))
+				return 1;
+	}
+	return 0;
+}
+
+/* The terrain is solid, a sphere overlaps it if its center is under the surface or if the
+ * surface is closer than the radius */
+static int sphereOverlapsHeightfield(Heightfield *hf, Vector3 center, float radius) {
+	if(heightfieldLocalHeight(hf, center.x, center.z, NULL) >= center.y) return 1;
+	float cs = hf->cellSize;
+	int x0 = (int)fmaxf(floorf((center.x - radius) / cs), 0), x1 = (int)fminf(floorf((center.x + radius) / cs), hf->cols - 1);
+	int z0 = (int)fmaxf(floorf((center.z - radius) / cs), 0), z1 = (int)fminf(floorf((center.z + radius) / cs), hf->rows - 1);
+	for(int x = x0; x <= x1; x++) {
+		for(int z = z0; z <= z1; z++) {
+			Vector3 v[6];
+			heightfieldCellTriangles(hf, x, z, v);
+			if(sphereTriangle(center, radius, v[0], v[1], v[2]) || sphereTriangle(center, radius, v[3], v[4], v[5])) return 1;
+		}
+	}
+	return 0;
+}
+
+/* Box or sphere of 'q' against the body 'r' */
+static int overlapsBody(PhysicsQuery *q, RigidBody *r) {
+	Vector3 extent = q->type == QUERY_BOX ? q->halfSize : (Vector3) { q->distance, q->distance, q->distance };
+	Vector3 min = Vector3Subtract(q->origin, extent);
+	Vector3 max = Vector3Add(q->origin, extent);
+	if(!boundsOverlap(r->box.vw[4], r->box.vw[2], min, max)) return 0;
+
+	if(q->type == QUERY_BOX) {
+		if(r->shape == SHAPE_HEIGHTFIELD) {
+			// the box is a body standing on the terrain, it overlaps if it sinks in it
+			RigidBody probe = { .box = createBox(Vector3Negate(extent), extent, q->origin) };
+			PhysicsStats stats = { 0 };
+			return boxAndHeightfield(&probe, r, &stats).length > 0;
+		}
+		if(r->collision) {
+			Box box = createBox(Vector3Negate(extent), extent, Vector3Subtract(q->origin, r->pos));
+			return boxOverlapsMesh(r->collision, &box);
+		}
+		return 1;
+	}
+
+	Vector3 center = Vector3Subtract(q->origin, r->pos);
+	if(r->shape == SHAPE_HEIGHTFIELD) return sphereOverlapsHeightfield(r->heightfield, center, q->distance);
+	if(r->collision) return sphereOverlapsMesh(r->collision, center, q->distance);
+	Vector3 d = Vector3Subtract(q->origin, Vector3Min(Vector3Max(q->origin, r->box.vw[4]), r->box.vw[2]));
+	return dotProduct(d, d) <= q->distance * q->distance;
+}
+
+static int cellInRange(CellRange *c, int x, int y, int z) {
+	return x >= c->minX && x <= c->maxX && y >= c->minY && y <= c->maxY && z >= c->minZ && z <= c->maxZ;
+}
+
+/* Tells if the entry 'k' of 'bucket' is the first one of its body. The cells of a body can hash
+ * to the same bucket, queries can't mark the bodies they visit since they run in parallel */
+static int firstInBucket(BroadphaseBucket *bucket, int k) {
+	RigidBody *r = slotBody(bucket->bodies[k]);
+	CellRange *c = &r->cells;
+	if(c->minX == c->maxX && c->minY == c->maxY && c->minZ == c->maxZ) return 1;
+	for(int i = 0; i < k; i++) if(bucket->bodies[i] == bucket->bodies[k]) return 0;
+	return 1;
+}
+
+/* Keeps the hit of the ray of 'q' on 'r' in 'result' if it is the nearest so far */
+static void rayCandidate(PhysicsQuery *q, RigidBody *r, QueryResult *result) {
+	Vector3 normal;
+	float t = rayBody(q, r, result->hits ? result->distance : q->distance, &normal);
+	if(t < 0) return;
+	if(result->hits && t == result->distance && compareHandles(r->handle, result->body) > 0) return;
+	result->hits = 1;
+	result->body = r->handle;
+	result->distance = t;
+	result->normal = normal;
+}
+
+/* Walks the broadphase cells crossed by the ray of 'q' in order. A body is tested in the first
+ * cell of the ray it is hashed into, with the whole of its shape, so once the nearest hit comes
+ * before the next cell no other body can be hit before it. The walk is clipped to the bounds of
+ * the broadphase and can't visit more cells than a ray crossing them, which also stops it when
+ * the steps get lost in the precision of very far away origins */
+static void queryRay(PhysicsQuery *q, QueryResult *result) {
+	Vector3 o = q->origin, d = q->direction;
+	RigidBody *staticWorld = getRigidBody(world.staticWorld);
+	if(staticWorld && queryAccepts(q, staticWorld)) rayCandidate(q, staticWorld, result);
+
+	Broadphase *bp = &world.broadphase;
+	if(bp->buckets == NULL || !bp->occupied) return;
+	CellRange *b = &bp->bounds;
+	int boundsMin[3] = { b->minX, b->minY, b->minZ };
+	int boundsMax[3] = { b->maxX, b->maxY, b->maxZ };
+	float tEnter = 0, tExit = q->distance;
+	for(int i = 0; i < 3; i++) {
+		float oi = (&o.x)[i], di = (&d.x)[i];
+		float lo = boundsMin[i] * BROADPHASE_CELL_SIZE, hi = (boundsMax[i] + 1) * BROADPHASE_CELL_SIZE;
+		if(di == 0) {
+			if(oi < lo || oi > hi) return;
+			continue;
+		}
+		float t0 = (lo - oi) / di, t1 = (hi - oi) / di;
+		if(t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+		if(t0 > tEnter) tEnter = t0;
+		if(t1 < tExit) tExit = t1;
+	}
+	if(tEnter > tExit) return;
+
+	Vector3 start = Vector3Add(o, Vector3Scale(d, tEnter));
+	int cell[3] = { cellCoord(start.x), cellCoord(start.y), cellCoord(start.z) };
+	int step[3];
+	float next[3], delta[3];
+	int budget = 1;
+	for(int i = 0; i < 3; i++) {
+		float di = (&d.x)[i];
+		// the entry point can round to a cell just outside the bounds
+		if(cell[i] < boundsMin[i]) cell[i] = boundsMin[i];
+		if(cell[i] > boundsMax[i]) cell[i] = boundsMax[i];
+		step[i] = di > 0 ? 1 : -1;
+		next[i] = di != 0 ? ((cell[i] + (di > 0)) * BROADPHASE_CELL_SIZE - (&o.x)[i]) / di : FLT_MAX;
+		delta[i] = di != 0 ? BROADPHASE_CELL_SIZE / fabsf(di) : FLT_MAX;
+		budget += boundsMax[i] - boundsMin[i];
+	}
+
+	int previous[3] = { 0, 0, 0 };
+	int first = 1;
+	for(; budget > 0; budget--) {
+		BroadphaseBucket *bucket = cellBucket(cell[0], cell[1], cell[2]);
+		for(int k = 0; k < bucket->count; k++) {
+			RigidBody *r = slotBody(bucket->bodies[k]);
+			// bodies of other cells with the same hash and bodies already tested are skipped
+			if(!cellInRange(&r->cells, cell[0], cell[1], cell[2])) continue;
+			if(!first && cellInRange(&r->cells, previous[0], previous[1], previous[2])) continue;
+			if(queryAccepts(q, r) && firstInBucket(bucket, k)) rayCandidate(q, r, result);
+		}
+
+		int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		if(next[axis] > tExit || (result->hits && result->distance <= next[axis])) break;
+		memcpy(previous, cell, sizeof(cell));
+		first = 0;
+		cell[axis] += step[axis];
+		next[axis] += delta[axis];
+	}
+}
+
+/* Keeps the body 'r' overlapping the box or the sphere of 'q' in 'result' and in 'bodies' */
+static void overlapCandidate(PhysicsQuery *q, RigidBody *r, QueryResult *result, BodyHandle *bodies, int max) {
+	if(!overlapsBody(q, r)) return;
+	if(result->hits < max) bodies[result->hits] = r->handle;
+	result->hits++;
+	float distance = Vector3Length(Vector3Subtract(q->origin, r->box.wCenter));
+	if(result->hits > 1 && (distance > result->distance ||
+	   (distance == result->distance && compareHandles(r->handle, result->body) > 0))) return;
+	result->body = r->handle;
+	result->distance = distance;
+}
+
+/* Visits the broadphase cells covered by the bounds of the box or the sphere of 'q'. A body is
+ * tested only in the first cell covered by both, so bodies spanning many cells are tested once */
+static void queryOverlaps(PhysicsQuery *q, QueryResult *result, BodyHandle *bodies, int max) {
+	RigidBody *staticWorld = getRigidBody(world.staticWorld);
+	if(staticWorld && queryAccepts(q, staticWorld)) overlapCandidate(q, staticWorld, result, bodies, max);
+
+	Broadphase *bp = &world.broadphase;
+	if(bp->buckets == NULL) return;
+	Vector3 extent = q->type == QUERY_BOX ? q->halfSize : (Vector3) { q->distance, q->distance, q->distance };
+	Vector3 min = Vector3Subtract(q->origin, extent);
+	Vector3 max3 = Vector3Add(q->origin, extent);
+	CellRange c = {
+		.minX = cellCoord(min.x),  .minY = cellCoord(min.y),  .minZ = cellCoord(min.z),
+		.maxX = cellCoord(max3.x), .maxY = cellCoord(max3.y), .maxZ = cellCoord(max3.z)
+	};
+	for(int x = c.minX; x <= c.maxX; x++) {
+		for(int y = c.minY; y <= c.maxY; y++) {
+			for(int z = c.minZ; z <= c.maxZ; z++) {
+				BroadphaseBucket *bucket = cellBucket(x, y, z);
+				for(int k = 0; k < bucket->count; k++) {
+					RigidBody *r = slotBody(bucket->bodies[k]);
+					CellRange *rc = &r->cells;
+					if(!cellInRange(rc, x, y, z)) continue;
+					if(x != (rc->minX > c.minX ? rc->minX : c.minX) ||
+					   y != (rc->minY > c.minY ? rc->minY : c.minY) ||
+					   z != (rc->minZ > c.minZ ? rc->minZ : c.minZ)) continue;
+					if(queryAccepts(q, r) && firstInBucket(bucket, k)) overlapCandidate(q, r, result, bodies, max);
+				}
+			}
+		}
+	}
+}
+
+/* Builds the deferred collision meshes the query 'q' can test, before it runs on a worker */
+static void buildQueryMeshes(PhysicsQuery *q) {
+	if(world.deferredMeshes == 0) return;
+	if(q->type == QUERY_RAY) {
+		buildCollisionMeshes();
+		return;
+	}
+	Vector3 extent = q->type == QUERY_BOX ? q->halfSize : (Vector3) { q->distance, q->distance, q->distance };
+	Vector3 min = Vector3Subtract(q->origin, extent);
+	Vector3 max = Vector3Add(q->origin, extent);
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(r->deferredMesh && queryAccepts(q, r) && boundsOverlap(r->box.vw[4], r->box.vw[2], min, max))
+			buildDeferredMesh(r);
+	}
+}
+
+/* Answers the query 'q' in 'result', overlap queries also store up to 'max' bodies in 'bodies' */
+static void runQuery(PhysicsQuery *q, QueryResult *result, BodyHandle *bodies, int max) {
+	*result = (QueryResult) { 0 };
+	if(q->type == QUERY_RAY) {
+		float length = Vector3Length(q->direction);
+		if(length == 0 || !(q->distance >= 0) || !isfinite(q->distance)) return;
+		PhysicsQuery ray = *q;
+		ray.direction = Vector3Scale(q->direction, 1 / length);
+		queryRay(&ray, result);
+		if(result->hits) result->point = Vector3Add(ray.origin, Vector3Scale(ray.direction, result->distance));
+	}
+	else if(q->type == QUERY_BOX || q->type == QUERY_SPHERE) {
+		queryOverlaps(q, result, bodies, max);
+	}
+	else {
+		fprintf(stderr, "ERROR unknown physics query type %d\n", q->type);
+		exit(1);
+	}
+}
+
+/* QueryBatch is the data of the jobs answering a batch of queries */
+typedef struct QueryBatch {
+	PhysicsQuery *queries;
+	QueryResult *results;
+} QueryBatch;
+
+static void queryJob(void *data, int worker, int first, int count) {
+	QueryBatch *batch = data;
+	for(int i = first; i < first + count; i++) runQuery(&batch->queries[i], &batch->results[i], NULL, 0);
+}
+
+void runPhysicsQueries(PhysicsQuery *queries, QueryResult *results, int count) {
+	if(count <= 0) return;
+	if(queries == NULL || results == NULL) {
+		fprintf(stderr, "ERROR cannot run physics queries without queries or results!\n");
+		exit(1);
+	}
+	for(int i = 0; i < count; i++) buildQueryMeshes(&queries[i]);
+	QueryBatch batch = { queries, results };
+	runParallel(queryJob, &batch, count);
+}
+
+int raycast(Vector3 origin, Vector3 direction, float distance, QueryResult *hit) {
+	PhysicsQuery q = { .type = QUERY_RAY, .origin = origin, .direction = direction, .distance = distance };
+	QueryResult result;
+	buildQueryMeshes(&q);
+	runQuery(&q, &result, NULL, 0);
+	if(hit) *hit = result;
+	return result.hits;
+}
+
+int overlapBox(Vector3 center, Vector3 halfSize, BodyHandle *bodies, int max) {
+	PhysicsQuery q = { .type = QUERY_BOX, .origin = center, .halfSize = halfSize };
+	QueryResult result;
+	buildQueryMeshes(&q);
+	runQuery(&q, &result, bodies, bodies ? max : 0);
+	return result.hits;
+}
+
+int overlapSphere(Vector3 center, float radius, BodyHandle *bodies, int max) {
+	PhysicsQuery q = { .type = QUERY_SPHERE, .origin = center, .distance = radius };
+	QueryResult result;
+	buildQueryMeshes(&q);
+	runQuery(&q, &result, bodies, bodies ? max : 0);
+	return result.hits;
+}
+
 /* ============= Collision Resolution Functions =============  */
 
 void handleCollision(RigidBody *a, RigidBody *b, CollisionInfo i, float frameTime) {
-	// TODO handle PHANTOM collisions
+	// phantoms are never pushed nor push, their overlaps are reported as trigger events
 	if(a->type == PHANTOM || b->type == PHANTOM) return;
 	if(a->type == RIGID_FIXED && b->type == RIGID_FIXED) return;
 	
+	// two moving bodies share the penetration and that's all
 	if(a->type == RIGID && b->type == RIGID) {
 		Vector3 dir = Vector3Scale(i.direction, i.length / 2);
-		a->pos = Vector3Add(a->pos, dir);
-		b->pos = Vector3Subtract(b->pos, dir);
+		updateRigidBodyPosition(a, Vector3Add(a->pos, dir));
+		updateRigidBodyPosition(b, Vector3Subtract(b->pos, dir));
+		return;
 	}
 	
 	Vector3 upNormal = { 0, i.direction.y, 0 };
@@ -420,49 +2389,747 @@ void handleCollision(RigidBody *a, RigidBody *b, CollisionInfo i, float frameTim
 	}
 	else { 
 		float slopeDir = dotProduct(b->vel, i.baseDirection);
-		if(slopeDir < 0) b->pos = Vector3Add(b->pos, offset); 
+		if(slopeDir < 0) updateRigidBodyPosition(b, Vector3Add(b->pos, offset));
 		else {
 			Vector3 normalizedVel = Vector3Normalize(b->vel);
-			b->pos = Vector3Add(b->pos, Vector3Scale(normalizedVel, -i.baseLength));
+			updateRigidBodyPosition(b, Vector3Add(b->pos, Vector3Scale(normalizedVel, -i.baseLength)));
+		}
+	}
+}
+
+/* ============= Recording Functions =============  */
+
+/* RecordingHeader starts a recording, it is followed by the slots, the collision meshes, the
+ * heightfields, the bodies, the broadphase buckets and the overlaps of the PHANTOM bodies, that's
+ * everything a step depends on. Bodies and meshes are written as they are in memory, so a
+ * recording can only be replayed by a build with the same layout */
+typedef struct RecordingHeader {
+	char magic[4];
+	unsigned int version;
+	int lanes;
+	int bodySize;
+	int nodeSize;
+	float gravity;
+	float fixedStep;
+	int maxSubsteps;
+	float accumulator;
+	int stepCount;
+	int bodyCount;
+	int slotCount;
+	int freeSlot;
+	BodyHandle staticWorld;
+	unsigned int queryStamp;
+	int meshCount;
+	int heightfieldCount;
+	int overlapCount;
+} RecordingHeader;
+
+/* RecordedMesh is followed by the BVH nodes and the quantized vertices of a collision mesh, the
+ * rest is computed again from the vertices when the recording is loaded */
+typedef struct RecordedMesh {
+	int triangleCount;
+	int nodeCount;
+	Vector3 qMin;
+	Vector3 qScale;
+	unsigned long long key;
+	int refs;
+} RecordedMesh;
+
+/* RecordedHeightfield is followed by the heights of a heightfield */
+typedef struct RecordedHeightfield {
+	int cols;
+	int rows;
+	float cellSize;
+} RecordedHeightfield;
+
+/* RecordedBody is a body with its collision mesh and heightfield given by their order in the
+ * recording, -1 if it has none */
+typedef struct RecordedBody {
+	int collision;
+	int heightfield;
+	RigidBody body;
+} RecordedBody;
+
+typedef enum {
+	RECORDED_UPDATE, // a call of updateWorld
+	RECORDED_STEP,   // a call of stepWorld
+	RECORDED_END     // the recording was stopped, a RecordingEnd follows
+} RecordedFrameType;
+
+/* RecordedFrame is followed by the 'inputCount' velocities the game set since the previous frame */
+typedef struct RecordedFrame {
+	RecordedFrameType type;
+	float frameTime;
+	int inputCount;
+} RecordedFrame;
+
+typedef struct RecordedInput {
+	int slot;
+	Vector3 vel;
+} RecordedInput;
+
+typedef struct RecordingEnd {
+	int frames;
+	unsigned long long checksum;
+} RecordingEnd;
+
+static const char recordingMagic[4] = { 'P', 'R', 'E', 'C' };
+
+static int writeBlock(FILE *f, const void *data, size_t size) {
+	return size == 0 || fwrite(data, size, 1, f) == 1;
+}
+
+static int readBlock(FILE *f, void *data, size_t size) {
+	return size == 0 || fread(data, size, 1, f) == 1;
+}
+
+/* Reads the world part of a recording, which can't stop halfway once the world is being replaced */
+static void readRecordedWorld(FILE *f, void *data, size_t size) {
+	if(!readBlock(f, data, size)) {
+		fprintf(stderr, "ERROR the physics recording is truncated\n");
+		exit(1);
+	}
+}
+
+/* Stores the velocities at the end of a frame, the next frame records the ones changed since */
+static void endRecordedFrame(void) {
+	for(int i = 0; i < world.bodyCount; i++)
+		world.recordedVel[world.bodies[i].handle.index] = world.bodies[i].vel;
+}
+
+static void recordFrame(RecordedFrameType type, float frameTime) {
+	if(world.slotCount != world.recordedSlots || world.bodyCount != world.recordedBodies) {
+		// the frames written so far can still be replayed
+		fprintf(stderr, "ERROR bodies were created or freed while recording, the recording ends here\n");
+		fclose(world.recording);
+		world.recording = NULL;
+		return;
+	}
+
+	RecordedFrame frame = { .type = type, .frameTime = frameTime, .inputCount = 0 };
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(memcmp(&r->vel, &world.recordedVel[r->handle.index], sizeof(r->vel))) frame.inputCount++;
+	}
+	int written = writeBlock(world.recording, &frame, sizeof(frame));
+	for(int i = 0; i < world.bodyCount && written; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(!memcmp(&r->vel, &world.recordedVel[r->handle.index], sizeof(r->vel))) continue;
+		RecordedInput input = { .slot = r->handle.index, .vel = r->vel };
+		written = writeBlock(world.recording, &input, sizeof(input));
+	}
+	if(!written) {
+		fprintf(stderr, "ERROR cannot write the physics recording, it ends here\n");
+		fclose(world.recording);
+		world.recording = NULL;
+		return;
+	}
+	world.recordedFrames++;
+}
+
+int startPhysicsRecording(const char *path) {
+	stopPhysicsRecording();
+	// the recording holds the collision meshes, so they have to be built
+	buildCollisionMeshes();
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR cannot write the physics recording %s\n", path);
+		return 0;
+	}
+	allocBroadphaseBuckets();
+
+	// shared meshes are written once, the bodies reference them by their order
+	int meshCount = 0, heightfieldCount = 0;
+	int count = world.bodyCount ? world.bodyCount : 1;
+	CollisionMesh **meshes = xmalloc(sizeof(*meshes) * count);
+	Heightfield **heightfields = xmalloc(sizeof(*heightfields) * count);
+	RecordedBody *bodies = xmalloc(sizeof(*bodies) * count);
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		bodies[i] = (RecordedBody) { .collision = -1, .heightfield = -1, .body = *r };
+		if(r->collision) {
+			int m = 0;
+			while(m < meshCount && meshes[m] != r->collision) m++;
+			if(m == meshCount) meshes[meshCount++] = r->collision;
+			bodies[i].collision = m;
+		}
+		if(r->heightfield) {
+			heightfields[heightfieldCount] = r->heightfield;
+			bodies[i].heightfield = heightfieldCount++;
+		}
+	}
+
+	RecordingHeader header = {
+		.version = PHYSICS_RECORDING_VERSION,
+		.lanes = SAT_LANES,
+		.bodySize = sizeof(RigidBody),
+		.nodeSize = sizeof(BVHNode),
+		.gravity = world.gravity,
+		.fixedStep = world.fixedStep,
+		.maxSubsteps = world.maxSubsteps,
+		.accumulator = world.accumulator,
+		.stepCount = world.stepCount,
+		.bodyCount = world.bodyCount,
+		.slotCount = world.slotCount,
+		.freeSlot = world.freeSlot,
+		.staticWorld = world.staticWorld,
+		.queryStamp = world.broadphase.queryStamp,
+		.meshCount = meshCount,
+		.heightfieldCount = heightfieldCount,
+		.overlapCount = world.overlapCount
+	};
+	memcpy(header.magic, recordingMagic, 4);
+	int written = writeBlock(f, &header, sizeof(header)) &&
+				  writeBlock(f, world.slots, sizeof(*world.slots) * world.slotCount);
+	for(int m = 0; m < meshCount && written; m++) {
+		CollisionMesh *cm = meshes[m];
+		RecordedMesh rm = {
+			.triangleCount = cm->triangleCount,
+			.nodeCount = cm->bvh.nodeCount,
+			.qMin = cm->qMin,
+			.qScale = cm->qScale,
+			.key = cm->key,
+			.refs = cm->refs
+		};
+		written = writeBlock(f, &rm, sizeof(rm)) &&
+				  writeBlock(f, cm->bvh.nodes, sizeof(BVHNode) * cm->bvh.nodeCount);
+		for(int k = 0; k < 9 && written; k++)
+			written = writeBlock(f, cm->q[k], sizeof(*cm->q[k]) * cm->triangleCount);
+	}
+	for(int h = 0; h < heightfieldCount && written; h++) {
+		Heightfield *hf = heightfields[h];
+		RecordedHeightfield rh = { .cols = hf->cols, .rows = hf->rows, .cellSize = hf->cellSize };
+		written = writeBlock(f, &rh, sizeof(rh)) &&
+				  writeBlock(f, hf->heights, sizeof(*hf->heights) * (hf->cols + 1) * (hf->rows + 1));
+	}
+	written = written && writeBlock(f, bodies, sizeof(*bodies) * world.bodyCount);
+	for(int i = 0; i < BROADPHASE_BUCKETS && written; i++) {
+		BroadphaseBucket *bucket = &world.broadphase.buckets[i];
+		written = writeBlock(f, &bucket->count, sizeof(bucket->count)) &&
+				  writeBlock(f, bucket->bodies, sizeof(*bucket->bodies) * bucket->count);
+	}
+	written = written && writeBlock(f, world.overlaps, sizeof(*world.overlaps) * world.overlapCount);
+	free(meshes);
+	free(heightfields);
+	free(bodies);
+	if(!written) {
+		fprintf(stderr, "ERROR cannot write the physics recording %s\n", path);
+		fclose(f);
+		remove(path);
+		return 0;
+	}
+
+	world.recording = f;
+	world.recordedSlots = world.slotCount;
+	world.recordedBodies = world.bodyCount;
+	world.recordedFrames = 0;
+	world.recordedVel = xrealloc(world.recordedVel, sizeof(*world.recordedVel) * (world.slotCount ? world.slotCount : 1));
+	endRecordedFrame();
+	return 1;
+}
+
+void stopPhysicsRecording(void) {
+	if(world.recording == NULL) return;
+	RecordedFrame frame = { .type = RECORDED_END };
+	RecordingEnd end = { .frames = world.recordedFrames, .checksum = getWorldChecksum() };
+	int written = writeBlock(world.recording, &frame, sizeof(frame)) &&
+				  writeBlock(world.recording, &end, sizeof(end));
+	if(fclose(world.recording) != 0 || !written)
+		fprintf(stderr, "ERROR cannot write the end of the physics recording\n");
+	world.recording = NULL;
+}
+
+PhysicsReplay *openPhysicsReplay(const char *path) {
+	if(world.bodyCount > 0 || world.slotCount > 0) {
+		fprintf(stderr, "ERROR a physics recording can only be replayed in an empty world\n");
+		exit(1);
+	}
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR cannot open the physics recording %s\n", path);
+		return NULL;
+	}
+	RecordingHeader header;
+	if(!readBlock(f, &header, sizeof(header)) || memcmp(header.magic, recordingMagic, 4) ||
+	   header.version != PHYSICS_RECORDING_VERSION || header.lanes != SAT_LANES ||
+	   header.bodySize != sizeof(RigidBody) || header.nodeSize != sizeof(BVHNode)) {
+		fprintf(stderr, "ERROR %s is not a physics recording made by this build\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	world.gravity = header.gravity;
+	world.fixedStep = header.fixedStep;
+	world.maxSubsteps = header.maxSubsteps;
+	world.accumulator = header.accumulator;
+	world.stepCount = header.stepCount;
+
+	world.slots = xrealloc(world.slots, sizeof(*world.slots) * (header.slotCount ? header.slotCount : 1));
+	readRecordedWorld(f, world.slots, sizeof(*world.slots) * header.slotCount);
+	world.slotCount = world.slotCapacity = header.slotCount;
+	world.freeSlot = header.freeSlot;
+
+	CollisionMesh **meshes = xmalloc(sizeof(*meshes) * (header.meshCount ? header.meshCount : 1));
+	for(int m = 0; m < header.meshCount; m++) {
+		RecordedMesh rm;
+		readRecordedWorld(f, &rm, sizeof(rm));
+		CollisionMesh *cm = xmalloc(sizeof(*cm));
+		cm->triangleCount = rm.triangleCount;
+		cm->qMin = rm.qMin;
+		cm->qScale = rm.qScale;
+		cm->key = rm.key;
+		cm->sourceVertices = 0;
+		cm->sourceIndices = 0;
+		cm->refs = rm.refs;
+		cm->mapped = NULL;
+		cm->mappedSize = 0;
+		cm->bvh.nodeCount = rm.nodeCount;
+		cm->bvh.nodes = xmalloc(sizeof(BVHNode) * rm.nodeCount);
+		readRecordedWorld(f, cm->bvh.nodes, sizeof(BVHNode) * rm.nodeCount);
+		cm->data = xmalloc(collisionDataSize(rm.triangleCount));
+		memset(cm->data, 0, collisionDataSize(rm.triangleCount));
+		setCollisionArrays(cm);
+		for(int k = 0; k < 9; k++) readRecordedWorld(f, cm->q[k], sizeof(*cm->q[k]) * rm.triangleCount);
+		for(int t = 0; t < rm.triangleCount; t++) setTriangleData(cm, t);
+		meshes[m] = cm;
+	}
+
+	Heightfield **heightfields = xmalloc(sizeof(*heightfields) * (header.heightfieldCount ? header.heightfieldCount : 1));
+	for(int h = 0; h < header.heightfieldCount; h++) {
+		RecordedHeightfield rh;
+		readRecordedWorld(f, &rh, sizeof(rh));
+		size_t size = sizeof(float) * (rh.cols + 1) * (rh.rows + 1);
+		float *heights = xmalloc(size);
+		readRecordedWorld(f, heights, size);
+		heightfields[h] = createHeightfield(rh.cols, rh.rows, rh.cellSize, heights);
+		free(heights);
+	}
+
+	world.bodies = xrealloc(world.bodies, sizeof(*world.bodies) * (header.bodyCount ? header.bodyCount : 1));
+	for(int i = 0; i < header.bodyCount; i++) {
+		RecordedBody rb;
+		readRecordedWorld(f, &rb, sizeof(rb));
+		if(rb.collision >= header.meshCount || rb.heightfield >= header.heightfieldCount) {
+			fprintf(stderr, "ERROR invalid body in the physics recording %s\n", path);
+			exit(1);
 		}
+		RigidBody *r = &world.bodies[i];
+		*r = rb.body;
+		r->mesh = NULL;
+		r->meshCount = 0;
+		r->contactCache = -1;
+		r->collision = rb.collision >= 0 ? meshes[rb.collision] : NULL;
+		r->heightfield = rb.heightfield >= 0 ? heightfields[rb.heightfield] : NULL;
+	}
+	world.bodyCount = world.bodyCapacity = header.bodyCount;
+	free(meshes);
+	free(heightfields);
+
+	// the buckets keep their order, it decides the order of the pairs
+	allocBroadphaseBuckets();
+	for(int i = 0; i < BROADPHASE_BUCKETS; i++) {
+		BroadphaseBucket *bucket = &world.broadphase.buckets[i];
+		readRecordedWorld(f, &bucket->count, sizeof(bucket->count));
+		if(bucket->count > bucket->capacity) {
+			bucket->capacity = bucket->count;
+			bucket->bodies = xrealloc(bucket->bodies, sizeof(*bucket->bodies) * bucket->capacity);
+		}
+		readRecordedWorld(f, bucket->bodies, sizeof(*bucket->bodies) * bucket->count);
+	}
+	world.broadphase.queryStamp = header.queryStamp;
+	for(int i = 0; i < world.bodyCount; i++)
+		if(world.bodies[i].inBroadphase) extendBroadphaseBounds(world.bodies[i].cells);
+
+	if(header.overlapCount > world.overlapCapacity) {
+		world.overlapCapacity = header.overlapCount;
+		world.overlaps = xrealloc(world.overlaps, sizeof(*world.overlaps) * world.overlapCapacity);
+	}
+	readRecordedWorld(f, world.overlaps, sizeof(*world.overlaps) * header.overlapCount);
+	world.overlapCount = header.overlapCount;
+	world.staticWorld = header.staticWorld;
+
+	PhysicsReplay *replay = xmalloc(sizeof(*replay));
+	*replay = (PhysicsReplay) { .f = f };
+	return replay;
+}
+
+int replayPhysicsFrame(PhysicsReplay *replay) {
+	RecordedFrame frame;
+	// a recording that was not stopped ends with its last complete frame
+	if(replay->f == NULL || !readBlock(replay->f, &frame, sizeof(frame))) return -1;
+	if(frame.type == RECORDED_END) {
+		RecordingEnd end;
+		if(readBlock(replay->f, &end, sizeof(end))) {
+			replay->recordedFrames = end.frames;
+			replay->recordedChecksum = end.checksum;
+			replay->complete = 1;
+		}
+		fclose(replay->f);
+		replay->f = NULL;
+		return -1;
+	}
+
+	for(int i = 0; i < frame.inputCount; i++) {
+		RecordedInput input;
+		if(!readBlock(replay->f, &input, sizeof(input))) return -1;
+		if(input.slot < 0 || input.slot >= world.slotCount || world.slots[input.slot].dense < 0) {
+			fprintf(stderr, "ERROR invalid body in the physics recording\n");
+			return -1;
+		}
+		slotBody(input.slot)->vel = input.vel;
+	}
+
+	int steps = 1;
+	if(frame.type == RECORDED_STEP) steps = stepWorld(frame.frameTime);
+	else updateWorld(frame.frameTime);
+	replay->frames++;
+	replay->steps += steps;
+	return steps;
+}
+
+void closePhysicsReplay(PhysicsReplay *replay) {
+	if(replay->f) fclose(replay->f);
+	free(replay);
+}
+
+unsigned long long getWorldChecksum(void) {
+	unsigned long long h = 14695981039346656037ULL;
+	for(int s = 0; s < world.slotCount; s++) {
+		if(world.slots[s].dense < 0) continue;
+		RigidBody *r = slotBody(s);
+		h = hashBytes(h, &s, sizeof(s));
+		h = hashBytes(h, &r->pos, sizeof(r->pos));
+		h = hashBytes(h, &r->vel, sizeof(r->vel));
+		h = hashBytes(h, &r->grounded, sizeof(r->grounded));
+		h = hashBytes(h, &r->sleeping, sizeof(r->sleeping));
 	}
+	return h;
 }
 
 /* ============= State Update Functions =============  */
 
+/* Runs the narrowphase on 'count' pairs starting from 'first' and stores the results in the
+ * buffer of 'worker'. Bodies are only read, they are updated after all the workers are done */
+static void narrowphaseJob(void *data, int worker, int first, int count) {
+	BodyPair *pairs = data;
+	NarrowphaseBuffer *buffer = &world.narrowphase[worker];
+	if(count > buffer->capacity) {
+		buffer->capacity = count;
+		buffer->results = xrealloc(buffer->results, sizeof(*buffer->results) * count);
+	}
+	buffer->first = first;
+	buffer->count = count;
+	for(int i = 0; i < count; i++) {
+		BodyPair *pair = &pairs[first + i];
+		ContactCache *cache = pair->contactCache >= 0 ? &world.contactCaches[pair->contactCache] : NULL;
+		buffer->results[i] = narrowphase(pair->a, pair->b, cache, &buffer->stats);
+	}
+}
+
+void wakeRigidBody(RigidBody *r) {
+	r->sleeping = 0;
+	r->sleepTimer = 0;
+}
+
+static int findIsland(int i) {
+	int *parent = world.islands;
+	while(parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+/* Updates the sleep timers of the awake bodies and groups the touching RIGID bodies in islands:
+ * an island falls asleep when all its bodies rested long enough, otherwise all of them are awake */
+static void updateSleeping(float frameTime) {
+	if(world.islandCapacity < world.bodyCount) {
+		world.islandCapacity = world.bodyCapacity;
+		world.islands = xrealloc(world.islands, sizeof(*world.islands) * world.islandCapacity);
+		world.islandAwake = xrealloc(world.islandAwake, sizeof(*world.islandAwake) * world.islandCapacity);
+	}
+	int *parent = world.islands;
+	for(int i = 0; i < world.bodyCount; i++) parent[i] = i;
+
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(r->type != RIGID || r->sleeping) continue;
+		// the actual displacement is used, so bodies pushed against a wall can sleep too
+		float speed = frameTime > 0 ? Vector3Length(Vector3Subtract(r->pos, r->prevPos)) / frameTime : 0;
+		if(r->grounded && speed < SLEEP_VELOCITY) r->sleepTimer += frameTime;
+		else r->sleepTimer = 0;
+	}
+
+	Broadphase *bp = &world.broadphase;
+	for(int i = 0; i < bp->pairCount; i++) {
+		BodyPair *pair = &bp->pairs[i];
+		if(pair->a->type != RIGID || pair->b->type != RIGID) continue;
+		int a = findIsland(pair->a - world.bodies);
+		int b = findIsland(pair->b - world.bodies);
+		if(a != b) parent[b] = a;
+	}
+
+	int *awake = world.islandAwake;
+	for(int i = 0; i < world.bodyCount; i++) awake[i] = 0;
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(r->type == RIGID && !r->sleeping && r->sleepTimer < SLEEP_TIME) awake[findIsland(i)] = 1;
+	}
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *r = &world.bodies[i];
+		if(r->type != RIGID) continue;
+		int root = findIsland(i);
+		if(root == i) world.stats.islands++;
+		if(awake[root]) {
+			if(r->sleeping) wakeRigidBody(r);
+		} else {
+			if(!r->sleeping) r->sleepVel = r->vel;
+			r->sleeping = 1;
+			world.stats.sleepingBodies++;
+		}
+	}
+}
+
+static void runStep(float frameTime);
+
+int stepWorld(float frameTime) {
+	if(world.fixedStep <= 0) {
+		updateWorld(frameTime);
+		return 1;
+	}
+
+	if(world.recording) recordFrame(RECORDED_STEP, frameTime);
+	// the trigger events are the ones of the steps of this call only
+	world.triggerEventCount = 0;
+	world.accumulator += frameTime;
+	int steps = 0;
+	while(world.accumulator >= world.fixedStep && steps < world.maxSubsteps) {
+		runStep(world.fixedStep);
+		world.accumulator -= world.fixedStep;
+		steps++;
+	}
+	// after a slow frame the time left is dropped, so the next frames don't need even more steps
+	if(world.accumulator >= world.fixedStep) world.accumulator = fmodf(world.accumulator, world.fixedStep);
+	if(world.recording) endRecordedFrame();
+	return steps;
+}
+
+void setFixedTimestep(float step, int maxSubsteps) {
+	world.fixedStep = step;
+	world.maxSubsteps = maxSubsteps < 1 ? 1 : maxSubsteps;
+	world.accumulator = 0;
+}
+
+float getStepAlpha(void) {
+	if(world.fixedStep <= 0) return 1;
+	return world.accumulator / world.fixedStep;
+}
+
+Vector3 getInterpolatedPosition(RigidBody *r) {
+	return Vector3Lerp(r->prevPos, r->pos, getStepAlpha());
+}
+
+void setPhysicsThreads(int count) {
+	startWorkers(count);
+}
+
+static int compareOverlaps(const void *a, const void *b) {
+	const TriggerOverlap *oa = a, *ob = b;
+	int c = compareHandles(oa->trigger, ob->trigger);
+	return c ? c : compareHandles(oa->body, ob->body);
+}
+
+static void addTriggerEvent(TriggerEventType type, TriggerOverlap *o) {
+	if(world.triggerEventCount == world.triggerEventCapacity) {
+		world.triggerEventCapacity = world.triggerEventCapacity ? world.triggerEventCapacity * 2 : 64;
+		world.triggerEvents = xrealloc(world.triggerEvents, sizeof(*world.triggerEvents) * world.triggerEventCapacity);
+	}
+	world.triggerEvents[world.triggerEventCount++] = (TriggerEvent) {
+		.type = type, .step = world.stats.step, .trigger = o->trigger, .body = o->body
+	};
+	world.stats.triggerEvents++;
+}
+
+/* Compares the overlaps of PHANTOM bodies found by the broadphase in this step with the ones of
+ * the previous step: both lists are sorted, so a single merge tells the new overlaps, the ones
+ * still there and the ones gone */
+static void updateTriggers(void) {
+	if(world.overlapCount > 1) qsort(world.overlaps, world.overlapCount, sizeof(*world.overlaps), compareOverlaps);
+
+	int i = 0, j = 0;
+	while(i < world.overlapCount || j < world.prevOverlapCount) {
+		int c = i == world.overlapCount ? 1 : j == world.prevOverlapCount ? -1 :
+				compareOverlaps(&world.overlaps[i], &world.prevOverlaps[j]);
+		if(c < 0) addTriggerEvent(TRIGGER_ENTER, &world.overlaps[i++]);
+		else if(c > 0) addTriggerEvent(TRIGGER_EXIT, &world.prevOverlaps[j++]);
+		else {
+			addTriggerEvent(TRIGGER_STAY, &world.overlaps[i++]);
+			j++;
+		}
+	}
+}
+
+TriggerEvent *drainTriggerEvents(int *count) {
+	*count = world.triggerEventCount;
+	return world.triggerEvents;
+}
+
+static double physicsClock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 void updateWorld(float frameTime) {
+	if(world.recording) recordFrame(RECORDED_UPDATE, frameTime);
+	world.triggerEventCount = 0;
+	runStep(frameTime);
+	if(world.recording) endRecordedFrame();
+}
+
+static void runStep(float frameTime) {
+	buildCollisionMeshes();
+	world.stats = (PhysicsStats) { 0 };
+	world.stats.step = world.stepCount++;
+	double start = physicsClock();
+
 	// update bodies position
 	for(int b = 0; b < world.bodyCount; b++) {
-		RigidBody *r = world.bodies[b];
+		RigidBody *r = &world.bodies[b];
+		r->prevPos = r->pos;
 		
 		if(r->type == RIGID_FIXED || r->type == PHANTOM) continue;
+		/* bodies moved by the game wake up, the others keep sleeping. Bodies still pushed like
+		 * when they fell asleep, e.g. against a wall, keep sleeping too since they didn't move */
+		if(r->sleeping) {
+			if(Vector3Length(r->vel) <= SLEEP_VELOCITY ||
+			   Vector3Length(Vector3Subtract(r->vel, r->sleepVel)) <= SLEEP_VELOCITY) continue;
+			wakeRigidBody(r);
+		}
 	
-		printf("GROUND DISTANCE: %f\n", r->groundDistance);
 		if(!r->grounded)
 			r->vel.y -= world.gravity;
-		printf("VELOCITY: (%f, %f, %f)\n", r->vel.x, r->vel.y, r->vel.z);	
 		Vector3 vel = Vector3Scale(r->vel, frameTime);
-		updateRigidBodyPosition(r, Vector3Add(r->pos, vel));
+		Vector3 size = Vector3Subtract(r->box.v[2], r->box.v[4]);
+		float smallest = fminf(size.x, fminf(size.y, size.z));
+		if(Vector3Length(vel) > smallest * SWEEP_FRACTION) {
+			moveSwept(r, vel);
+			world.stats.sweptBodies++;
+		}
+		else updateRigidBodyPosition(r, Vector3Add(r->pos, vel));
 	}
 
+	double integrated = physicsClock();
+	world.stats.integrateTime = integrated - start;
+
+	// find the candidate pairs
+	broadphaseFindPairs();
+
 	// check collisions
-	for(int i = 0; i < world.bodyCount-1; i++) {
-		RigidBody *a = world.bodies[i];
-		a->groundDistance = a->pos.y;
-		if(a->type == RIGID_FIXED || a->type == PHANTOM) continue;
-		
-		for(int y = i+1; y < world.bodyCount; y++) {
-			RigidBody *b = world.bodies[y];
-			CollisionInfo info = checkCollision(a,b);
-			if(info.length > 0)	handleCollision(a, b, info, frameTime);
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *a = &world.bodies[i];
+		if(!a->sleeping) a->groundDistance = a->pos.y;
+	}
+
+	Broadphase *bp = &world.broadphase;
+	world.stats.pairs = bp->pairCount;
+	int workers = getWorkerCount();
+	for(int w = 0; w < workers; w++) {
+		world.narrowphase[w].count = 0;
+		world.narrowphase[w].stats = (PhysicsStats) { 0 };
+	}
+	runParallel(narrowphaseJob, bp->pairs, bp->pairCount);
+	double collided = physicsClock();
+	world.stats.collideTime = collided - integrated;
+
+	/* results are applied in pair order whatever the number of workers,
+	 * so the simulation is the same for any thread count */
+	for(int w = 0; w < workers; w++) {
+		NarrowphaseBuffer *buffer = &world.narrowphase[w];
+		for(int i = 0; i < buffer->count; i++) {
+			BodyPair *pair = &bp->pairs[buffer->first + i];
+			CollisionInfo *info = &buffer->results[i];
+			if(info->groundDistance < pair->a->groundDistance) pair->a->groundDistance = info->groundDistance;
+			if(pair->b->type == RIGID && info->bGroundDistance < pair->b->groundDistance)
+				pair->b->groundDistance = info->bGroundDistance;
+			if(info->length > 0) handleCollision(pair->a, pair->b, *info, frameTime);
 		}
+		world.stats.trianglesVisited  += buffer->stats.trianglesVisited;
+		world.stats.trianglesInMeshes += buffer->stats.trianglesInMeshes;
+		world.stats.groundProbeHits   += buffer->stats.groundProbeHits;
+		world.stats.aabbRejects       += buffer->stats.aabbRejects;
+		world.stats.contactCacheHits  += buffer->stats.contactCacheHits;
+		for(int a = 0; a < SAT_AXES; a++) world.stats.satEarlyOuts[a] += buffer->stats.satEarlyOuts[a];
+	}
+
+	for(int i = 0; i < world.bodyCount; i++) {
+		RigidBody *a = &world.bodies[i];
+		if(a->type == RIGID_FIXED || a->type == PHANTOM || a->sleeping) continue;
 		if(!a->grounded && a->groundDistance <= a->box.v[1].y + GROUND_ENTER_EPS)
 			a->grounded = 1;
 		else if(a->grounded && a->groundDistance > a->box.v[1].y + GROUND_EXIT_EPS)
 			a->grounded = 0;
 	}
 
+	updateSleeping(frameTime);
+	updateTriggers();
+	world.stats.resolveTime = physicsClock() - collided;
+
+	world.trace[world.traceNext] = world.stats;
+	world.traceNext = (world.traceNext + 1) % PHYSICS_TRACE_SIZE;
+	if(world.traceCount < PHYSICS_TRACE_SIZE) world.traceCount++;
+}
 
+PhysicsStats getPhysicsStats(void) {
+	return world.stats;
+}
+
+int getPhysicsTrace(PhysicsStats *steps, int max) {
+	int count = world.traceCount < max ? world.traceCount : max;
+	// the oldest of the last 'count' steps
+	int first = (world.traceNext - count + PHYSICS_TRACE_SIZE) % PHYSICS_TRACE_SIZE;
+	for(int i = 0; i < count; i++) steps[i] = world.trace[(first + i) % PHYSICS_TRACE_SIZE];
+	return count;
+}
+
+void writePhysicsTraceCSV(FILE *f) {
+	fprintf(f, "step,integrate_us,collide_us,resolve_us,pairs,aabb_rejects,triangles_visited,"
+			   "triangles_in_meshes,ground_probe_hits,sleeping_bodies,islands,swept_bodies,trigger_events,contact_cache_hits");
+	for(int a = 0; a < SAT_AXES; a++) fprintf(f, ",sat_early_outs_%d", a);
+	fprintf(f, "\n");
+
+	PhysicsStats steps[PHYSICS_TRACE_SIZE];
+	int count = getPhysicsTrace(steps, PHYSICS_TRACE_SIZE);
+	for(int i = 0; i < count; i++) {
+		PhysicsStats *s = &steps[i];
+		fprintf(f, "%d,%.2f,%.2f,%.2f,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", s->step,
+				s->integrateTime * 1e6, s->collideTime * 1e6, s->resolveTime * 1e6,
+				s->pairs, s->aabbRejects, s->trianglesVisited, s->trianglesInMeshes,
+				s->groundProbeHits, s->sleepingBodies, s->islands, s->sweptBodies, s->triggerEvents,
+				s->contactCacheHits);
+		for(int a = 0; a < SAT_AXES; a++) fprintf(f, ",%d", s->satEarlyOuts[a]);
+		fprintf(f, "\n");
+	}
+}
+
+void writePhysicsTraceJSON(FILE *f) {
+	PhysicsStats steps[PHYSICS_TRACE_SIZE];
+	int count = getPhysicsTrace(steps, PHYSICS_TRACE_SIZE);
+	fprintf(f, "[\n");
+	for(int i = 0; i < count; i++) {
+		PhysicsStats *s = &steps[i];
+		fprintf(f, "  {\"step\": %d, \"integrate_us\": %.2f, \"collide_us\": %.2f, \"resolve_us\": %.2f, "
+				   "\"pairs\": %d, \"aabb_rejects\": %d, \"triangles_visited\": %d, \"triangles_in_meshes\": %d, "
+				   "\"ground_probe_hits\": %d, \"sleeping_bodies\": %d, \"islands\": %d, \"swept_bodies\": %d, "
+				   "\"trigger_events\": %d, \"contact_cache_hits\": %d, \"sat_early_outs\": [", s->step,
+				s->integrateTime * 1e6, s->collideTime * 1e6, s->resolveTime * 1e6,
+				s->pairs, s->aabbRejects, s->trianglesVisited, s->trianglesInMeshes,
+				s->groundProbeHits, s->sleepingBodies, s->islands, s->sweptBodies, s->triggerEvents,
+				s->contactCacheHits);
+		for(int a = 0; a < SAT_AXES; a++) fprintf(f, a ? ", %d" : "%d", s->satEarlyOuts[a]);
+		fprintf(f, i + 1 < count ? "]},\n" : "]}\n");
+	}
+	fprintf(f, "]\n");
 }
 
 /* ============= Vector Utility Functions =============  */
@@ -2,10 +2,58 @@
 #define PHYSICS_H
 
 #include "raylib/src/raylib.h"
+#include "jobs.h"
 #include <math.h>
+#include <stdio.h>
 
 #define GROUND_ENTER_EPS 0
 #define GROUND_EXIT_EPS 0
+/* number of vertical probes used to measure the ground distance of a box */
+#define GROUND_PROBES 5
+/* triangles whose normal has a smaller vertical component are ignored by the ground probes */
+#define GROUND_PROBE_MIN_NORMAL 0.000001f
+
+/* a body whose position changes slower than SLEEP_VELOCITY while grounded for SLEEP_TIME
+ * seconds falls asleep together with the bodies it touches, whatever its velocity, e.g. when it
+ * is pushed against a wall. It wakes up when the game gives it another velocity */
+#define SLEEP_VELOCITY 0.05f
+#define SLEEP_TIME 0.5f
+/* bodies moving more than SWEEP_FRACTION of their smallest side in a step are swept against the
+ * walls of the static meshes, stopping SWEEP_SKIN before the wall and sliding along it for at
+ * most SWEEP_ITERATIONS hits, then stopping at the next wall */
+#define SWEEP_FRACTION 0.5f
+#define SWEEP_SKIN 0.001f
+#define SWEEP_ITERATIONS 3
+/* number of SAT axes tested between a box and a triangle */
+#define SAT_AXES 13
+/* number of recent steps kept in the stats trace */
+#define PHYSICS_TRACE_SIZE 256
+/* version of the static world cache files, to be incremented when their layout changes */
+#define STATIC_WORLD_VERSION 2
+/* version of the physics recordings, to be incremented when their layout changes */
+#define PHYSICS_RECORDING_VERSION 2
+/* size of a broadphase cell, it should be close to the size of the moving bodies */
+#define BROADPHASE_CELL_SIZE 1.0f
+/* number of buckets of the broadphase spatial hash, it must be a power of two */
+#define BROADPHASE_BUCKETS 4096
+/* the BVH leaves near a box are cached for each box vs mesh pair, from the region around the box
+ * grown by CONTACT_CACHE_MARGIN on every side. The cache is used until the box leaves that region */
+#define CONTACT_CACHE_MARGIN 0.2f
+
+/* number of triangles tested by a single call of the SAT kernel, it is 8 when the kernel
+ * is built with AVX2 and 4 with SSE2 or with the scalar fallback (define PHYSICS_SCALAR
+ * to force the scalar kernel) */
+#if defined(__AVX2__) && !defined(PHYSICS_SCALAR)
+#define SAT_LANES 8
+#else
+#define SAT_LANES 4
+#endif
+
+/* maximum number of triangles stored in a leaf of a mesh BVH, a leaf is tested with a single
+ * call of the SAT kernel */
+#define BVH_LEAF_SIZE SAT_LANES
+/* maximum depth of a mesh BVH traversal */
+#define BVH_STACK_SIZE 64
 
 /* =============== Structs =============== */
 
@@ -15,6 +63,12 @@ typedef enum {
 	PHANTOM      // phantom bodies allow overlapping (e.g. a trigger)
 } BodyType;
 
+typedef enum {
+	SHAPE_BOX,        // the box of the body
+	SHAPE_MESH,       // the triangles of the meshes of the body
+	SHAPE_HEIGHTFIELD // a grid of heights (e.g. the terrain)
+} ShapeType;
+
 /* Box is the structure holding all the data needed by SAT for a box
  * 'v'  is the array containing the 8 vertices of the box
  * 'vw' is the array containing the 8 vertices of the box translated in the world position
@@ -30,19 +84,117 @@ typedef struct Box {
 	Vector3 wCenter;
 } Box;
 
+/* CellRange is the range of broadphase cells covered by the world bounds of a body */
+typedef struct CellRange {
+	int minX, minY, minZ;
+	int maxX, maxY, maxZ;
+} CellRange;
+
+/* BVHNode is a node of a mesh BVH, bounds are in body local space.
+ * Internal nodes have 'count' 0, their left child is the next node and 'right' is the index
+ * of the right child. Leaves reference 'count' triangles starting from 'first' */
+typedef struct BVHNode {
+	Vector3 min;
+	Vector3 max;
+	int right;
+	int first;
+	int count;
+} BVHNode;
+
+/* MeshBVH is the bounding volume hierarchy built over the triangles of a collision mesh */
+typedef struct MeshBVH {
+	BVHNode *nodes;
+	int nodeCount;
+} MeshBVH;
+
+/* CollisionMesh stores the triangles of the meshes of a body in body local space, sorted
+ * in BVH order so that the triangles of each leaf are contiguous. Everything SAT needs is
+ * computed once at creation and kept in structure of arrays form:
+ * 'q'     the 3 vertices quantized to 16 bits inside the bounds of the mesh, q[k * 3 + c] is
+ *         the component c (x, y, z) of vertex k, which is qMin.c + q[k * 3 + c] * qScale.c.
+ *         The other arrays are computed from the quantized vertices so they all agree
+ * 'n'     the normalized face normal
+ * 'c'     the centroid
+ * 'axes'  the normalized vector products between the box axes and the sides,
+ *         axes[(j * 3 + k) * 3 + c] is the component c of box axis j times side k.
+ *         Boxes are always axis aligned, so the box axes are the ones set by createBox.
+ * 'mapped' is the file mapping holding 'data' and the BVH nodes of a mesh loaded from a cache,
+ * NULL if they were allocated. A mesh can be shared by many bodies, 'refs' counts them and 'key'
+ * is the hash of the source triangles it is found by in the cache of the world. 'sourceVertices'
+ * and 'sourceIndices' count the vertices and indices of the source meshes, they are checked with
+ * the bounds before a mesh whose key matches is shared */
+typedef struct CollisionMesh {
+	int triangleCount;
+	unsigned short *q[9];
+	Vector3 qMin;
+	Vector3 qScale;
+	float *n[3];
+	float *c[3];
+	float *axes[27];
+	float *xz[4];
+	float *h[3];
+	float *data;
+	MeshBVH bvh;
+	void *mapped;
+	size_t mappedSize;
+	unsigned long long key;
+	int sourceVertices;
+	int sourceIndices;
+	int refs;
+} CollisionMesh;
+
+/* Heightfield is a grid of 'cols' x 'rows' square cells of side 'cellSize' lying on the xz plane,
+ * from (0, 0) to (cols * cellSize, rows * cellSize) in body local space. 'heights' holds the
+ * (cols + 1) * (rows + 1) heights of the cell corners, row by row along x. Each cell is split in
+ * two triangles by the diagonal from its corner (x + 1, z) to (x, z + 1), like the planes made
+ * by raylib, so the height between corners is the one of the triangles */
+typedef struct Heightfield {
+	int cols;
+	int rows;
+	float cellSize;
+	float *heights;
+	float minHeight;
+	float maxHeight;
+} Heightfield;
+
+/* BodyHandle identifies a rigid body of the world. 'index' is the slot of the body and
+ * 'generation' is incremented every time the slot is freed, so handles to freed bodies
+ * are detected. The zero handle is never valid */
+typedef struct BodyHandle {
+	int index;
+	unsigned int generation;
+} BodyHandle;
+
 typedef struct RigidBody {
 	BodyType type;
+	ShapeType shape;
+	BodyHandle handle;
 	Vector3 pos;
+	Vector3 prevPos;
 	Vector3 vel;
 	Box box;
 	Mesh *mesh;
 	int meshCount;
+	/* 'deferredMesh' is set while the collision mesh of a RIGID_FIXED body made from 'mesh' is
+	 * not built yet, it is built the first time the body is tested or not at all if it is baked */
+	CollisionMesh *collision;
+	int deferredMesh;
+	Heightfield *heightfield;
 	float groundDistance;
 	int grounded;
-	/* This function pointer is the callback that will be called after a collision is detected
-	 * it returns the amount of displacement that the rigid body had been moved by after
-	 * the collision resolution */
-	Vector3 (*callback)(struct RigidBody *a, struct RigidBody *b); 
+	/* sleeping bodies are not moved nor checked for collisions until something wakes them,
+	 * 'sleepTimer' is for how long the body has been resting and 'sleepVel' its velocity when it
+	 * fell asleep */
+	int sleeping;
+	float sleepTimer;
+	Vector3 sleepVel;
+	/* broadphase data: the cells the body is hashed into and the stamp of the last query
+	 * that visited the body, used to report each candidate only once */
+	CellRange cells;
+	int inBroadphase;
+	unsigned int queryStamp;
+	/* the first of the contact caches of the pairs of the body, -1 if it has none */
+	int contactCache;
 } RigidBody;
 
 typedef struct CollisionInfo {
@@ -53,46 +205,340 @@ typedef struct CollisionInfo {
 	Vector3 v1;
 	Vector3 v2;
 	Vector3 v3;
+	/* the ground distances of 'a' and 'b' lowered by this pair, 'b' is only grounded by a box 'a'
+	 * standing on it when both are boxes */
 	float groundDistance;
+	float bGroundDistance;
 } CollisionInfo;
 
+/* BodyPair is a candidate pair produced by the broadphase, 'a' is always a RIGID body.
+ * 'contactCache' is the cache of the pair if 'b' is a mesh, -1 otherwise */
+typedef struct BodyPair {
+	RigidBody *a;
+	RigidBody *b;
+	int contactCache;
+} BodyPair;
+
+/* ContactCache holds the BVH leaves of the mesh 'mesh' of the body 'b' that overlap the region
+ * from 'min' to 'max', in the local space of 'b', in the order the BVH is traversed. While the
+ * query region of the box of the RIGID body owning the cache stays inside it, the box is tested
+ * against these leaves only and the BVH is not traversed at all. 'step' is the last step the pair
+ * was found and 'next' the next cache of the same body, or the next free cache */
+typedef struct ContactCache {
+	BodyHandle b;
+	CollisionMesh *mesh;
+	Vector3 min;
+	Vector3 max;
+	int *leaves;
+	int leafCount;
+	int leafCapacity;
+	int step;
+	int next;
+} ContactCache;
+
+/* BroadphaseBucket holds the slot indices of the bodies hashed into it, slots do not
+ * change when bodies are moved inside the world storage */
+typedef struct BroadphaseBucket {
+	int *bodies;
+	int count;
+	int capacity;
+} BroadphaseBucket;
+
+/* Broadphase is a uniform spatial hash over the box world bounds. Bodies are inserted
+ * once and re-hashed only when updateRigidBodyPosition moves them to different cells,
+ * so fixed bodies cost nothing after their creation. 'bounds' is the range of all the cells
+ * a body was inserted into, it only grows and it is empty while 'occupied' is 0 */
+typedef struct Broadphase {
+	BroadphaseBucket *buckets;
+	CellRange bounds;
+	int occupied;
+	BodyPair *pairs;
+	int pairCount;
+	int pairCapacity;
+	unsigned int queryStamp;
+} Broadphase;
+
+/* PhysicsStats holds the counters of a world update, 'step' is its number and the times are in
+ * seconds: 'integrateTime' moves the bodies, 'collideTime' runs broadphase and narrowphase and
+ * 'resolveTime' applies the results. 'aabbRejects' is the number of candidates discarded by a
+ * bounding box test, 'trianglesVisited' is the number of triangles tested by the narrowphase,
+ * 'trianglesInMeshes' is the number of triangles of the meshes it queried, 'satEarlyOuts[i]'
+ * the number of triangles separated by the i-th axis tested (the triangle normal, then each box
+ * axis followed by its products with the triangle sides), 'groundProbeHits' the number of ground
+ * probes that hit a triangle, 'sleepingBodies' the number of sleeping RIGID bodies, 'islands'
+ * the number of groups of touching RIGID bodies, 'sweptBodies' the number of bodies moved
+ * with a swept test, 'triggerEvents' the number of trigger events recorded and 'contactCacheHits'
+ * the number of box vs mesh pairs tested against their cached leaves without traversing the BVH */
+typedef struct PhysicsStats {
+	int step;
+	double integrateTime;
+	double collideTime;
+	double resolveTime;
+	int pairs;
+	int aabbRejects;
+	int trianglesVisited;
+	int trianglesInMeshes;
+	int groundProbeHits;
+	int sleepingBodies;
+	int islands;
+	int sweptBodies;
+	int triggerEvents;
+	int contactCacheHits;
+	int satEarlyOuts[SAT_AXES];
+} PhysicsStats;
+
+/* TriggerEventType tells if a body started, kept or stopped overlapping a PHANTOM body */
+typedef enum TriggerEventType {
+	TRIGGER_ENTER,
+	TRIGGER_STAY,
+	TRIGGER_EXIT
+} TriggerEventType;
+
+/* TriggerEvent reports that the RIGID body 'body' overlaps the PHANTOM body 'trigger' in the
+ * step 'step'. The bodies of an exit event may have been freed since */
+typedef struct TriggerEvent {
+	TriggerEventType type;
+	int step;
+	BodyHandle trigger;
+	BodyHandle body;
+} TriggerEvent;
+
+/* TriggerOverlap is a RIGID body overlapping a PHANTOM body at the end of a step */
+typedef struct TriggerOverlap {
+	BodyHandle trigger;
+	BodyHandle body;
+} TriggerOverlap;
+
+typedef enum {
+	QUERY_RAY,   // the first body hit by a ray
+	QUERY_BOX,   // the bodies overlapping an axis aligned box
+	QUERY_SPHERE // the bodies overlapping a sphere
+} QueryType;
+
+/* PhysicsQuery is a question to the world, answered with the broadphase and the shapes of the bodies:
+ * QUERY_RAY     the ray from 'origin' along 'direction' (any length) up to 'distance', rays with
+ *               a negative or infinite 'distance' hit nothing
+ * QUERY_BOX     the box of center 'origin' and half size 'halfSize'
+ * QUERY_SPHERE  the sphere of center 'origin' and radius 'distance'
+ * Only the bodies whose type is in the mask 'types' and whose shape is in the mask 'shapes' are
+ * considered, like (1 << RIGID) or (1 << SHAPE_MESH). A zero 'types' means the RIGID and
+ * RIGID_FIXED bodies and a zero 'shapes' means every shape. 'ignore' is left out, e.g. the body
+ * asking. Heightfields are solid below their surface */
+typedef struct PhysicsQuery {
+	QueryType type;
+	Vector3 origin;
+	Vector3 direction;
+	Vector3 halfSize;
+	float distance;
+	int types;
+	int shapes;
+	BodyHandle ignore;
+} PhysicsQuery;
+
+/* QueryResult is the answer to a query: 'hits' is the number of bodies found, at most 1 for rays,
+ * and 'body' the nearest one at 'distance'. For rays it is the first body hit, 'point' is where
+ * and 'normal' the normal of the surface there. For overlaps it is the body whose box center is
+ * the closest to the query origin */
+typedef struct QueryResult {
+	int hits;
+	BodyHandle body;
+	float distance;
+	Vector3 point;
+	Vector3 normal;
+} QueryResult;
+
+/* NarrowphaseBuffer holds the results of the pairs 'first' to 'first' + 'count' computed
+ * by a single worker and the counters of its work */
+typedef struct NarrowphaseBuffer {
+	CollisionInfo *results;
+	int capacity;
+	int first;
+	int count;
+	PhysicsStats stats;
+} NarrowphaseBuffer;
+
+/* BodySlot maps a handle to the position of its body in the world storage, 'dense' is -1
+ * for free slots, which are linked through 'nextFree' */
+typedef struct BodySlot {
+	int dense;
+	unsigned int generation;
+	int nextFree;
+} BodySlot;
+
+/* World stores the bodies contiguously in 'bodies', so iterating them is linear. Freeing a body
+ * moves the last body in its place, bodies must be referenced through handles because
+ * their address changes when bodies are created or freed */
 typedef struct World {
 	float gravity;
+	/* fixed timestep mode: 'fixedStep' is the duration of a step (0 disables the mode),
+	 * 'maxSubsteps' is the maximum number of steps per frame and 'accumulator' is the
+	 * simulation time not consumed yet */
+	float fixedStep;
+	int maxSubsteps;
+	float accumulator;
 	int bodyCount;
-	int maxBodies;
-	RigidBody *bodies[1000];
+	int bodyCapacity;
+	RigidBody *bodies;
+	BodySlot *slots;
+	int slotCount;
+	int slotCapacity;
+	int freeSlot;
+	Broadphase broadphase;
+	/* union-find parent of each body, by dense index, used to group touching bodies in islands,
+	 * and whether the island rooted at each body has to stay awake */
+	int *islands;
+	int *islandAwake;
+	int islandCapacity;
+	NarrowphaseBuffer narrowphase[MAX_WORKERS];
+	/* the overlaps of PHANTOM bodies found by the last two steps, sorted by handles, and the
+	 * events recorded by the last call to stepWorld or updateWorld */
+	TriggerOverlap *overlaps;
+	int overlapCount;
+	int overlapCapacity;
+	TriggerOverlap *prevOverlaps;
+	int prevOverlapCount;
+	int prevOverlapCapacity;
+	TriggerEvent *triggerEvents;
+	int triggerEventCount;
+	int triggerEventCapacity;
+	/* the collision meshes shared by the bodies made from the same meshes */
+	CollisionMesh **meshCache;
+	int meshCacheCount;
+	int meshCacheCapacity;
+	/* the number of bodies whose collision mesh is deferred */
+	int deferredMeshes;
+	/* the contact caches of the box vs mesh pairs, the free ones are linked from 'freeContactCache' */
+	ContactCache *contactCaches;
+	int contactCacheCount;
+	int contactCacheCapacity;
+	int freeContactCache;
+	/* the body holding the merged triangles of the baked RIGID_FIXED bodies, it is not in the
+	 * broadphase and every RIGID body overlapping its box is paired with it */
+	BodyHandle staticWorld;
+	PhysicsStats stats;
+	/* ring buffer of the stats of the last PHYSICS_TRACE_SIZE steps, 'traceNext' is where
+	 * the next step goes */
+	int stepCount;
+	PhysicsStats trace[PHYSICS_TRACE_SIZE];
+	int traceNext;
+	int traceCount;
+	/* the log the inputs of each frame are written to while recording, 'recordedVel' holds the
+	 * velocity of each slot at the end of the last frame so only the ones the game changed are
+	 * written, 'recordedSlots' and 'recordedBodies' are the numbers of slots and bodies when the
+	 * recording started */
+	FILE *recording;
+	Vector3 *recordedVel;
+	int recordedSlots;
+	int recordedBodies;
+	int recordedFrames;
 } World;
 
+/* PhysicsReplay reads back a recording: the world it started from is loaded when it is opened and
+ * each frame applies the recorded velocities and updates the world like the game did. 'frames' and
+ * 'steps' count the frames and the steps replayed so far, 'recordedFrames' and 'recordedChecksum'
+ * come from the end of the recording and 'complete' tells if it was found, it is missing if the
+ * recording was not stopped */
+typedef struct PhysicsReplay {
+	FILE *f;
+	int frames;
+	int steps;
+	int recordedFrames;
+	unsigned long long recordedChecksum;
+	int complete;
+} PhysicsReplay;
+
 /* =============== Constants =============== */
 
 static constexpr Vector3 upVector = (Vector3) { 0, 1, 0 };
 static constexpr float maxSlope = cos(3.141592654 / 3);
-static World world = {
-	.gravity = 2,
-	.bodyCount = 0,
-	.maxBodies = 1000
-};
+extern World world;
 
 /* =============== Structs Manipulation Functions =============== */
 
-/* Creates a pointer to a rigid body using the position 'x' and 'y' (top left) and the size 'width' and
- * 'height' to determine the rect for collision handling in AABB */
-RigidBody *createRigidBody(BodyType type, Vector3 position, Vector3 size);
+/* Creates a rigid body centered in 'position' with a box of size 'size' and returns its handle */
+BodyHandle createRigidBody(BodyType type, Vector3 position, Vector3 size);
+
+/* Creates a rigid body using the array of meshes 'mesh' to determine
+ * the box for collision handling in AABB and returns its handle. The collision mesh is shared
+ * with the other bodies of the same meshes. A RIGID_FIXED body builds it the first time it is
+ * tested, so its meshes must stay loaded until then, or until it is baked into the static world */
+BodyHandle createRigidBodyFromMesh(BodyType type, Mesh *meshes, int meshCount, Vector3 position);
+
+/* Builds the collision meshes deferred by createRigidBodyFromMesh, the world does it before
+ * anything tests the bodies. It can be called to keep that work out of the first step */
+void buildCollisionMeshes(void);
+
+/* Creates a RIGID_FIXED body with the heightfield 'hf', its grid starts from 'position'.
+ * The body owns the heightfield, it is freed with the body */
+BodyHandle createRigidBodyFromHeightfield(Heightfield *hf, Vector3 position);
+
+/* Creates a heightfield of 'cols' x 'rows' cells of side 'cellSize' copying the
+ * (cols + 1) * (rows + 1) corner heights from 'heights' */
+Heightfield *createHeightfield(int cols, int rows, float cellSize, float *heights);
 
-/* Creates a pointer to a rigid body using the array of meshes 'mesh' to determine
- * the box for collision handling in AABB */
-RigidBody *createRigidBodyFromMesh(BodyType type, Mesh *meshes, int meshCount, Vector3 position);
+/* Frees the memory allocated to the heightfield 'hf' */
+void freeHeightfield(Heightfield *hf);
+
+/* Returns the height of the heightfield body 'r' under the world point 'x', 'z' in constant time,
+ * points outside the grid take the height of the nearest edge */
+float getHeightfieldHeight(RigidBody *r, float x, float z);
+
+/* Returns the normal of the heightfield body 'r' under the world point 'x', 'z' in constant time */
+Vector3 getHeightfieldNormal(RigidBody *r, float x, float z);
+
+/* Returns the rigid body identified by 'h' or NULL if it has been freed. The pointer is valid
+ * until the next body is created or freed */
+RigidBody *getRigidBody(BodyHandle h);
 
 /* Creates a Box pointer defining the vertices using the minSize and maxSize vector3
  * and calculating the separating axis to check for SAT  */
 Box createBox(Vector3 minSize, Vector3 maxSize, Vector3 position);
 
-/* Frees the memory allocated to a rigid body 'r' */
-void freeRigidBody(RigidBody *r);
+/* Builds the collision mesh and its BVH from the triangles of the array of meshes 'meshes',
+ * the meshes are not referenced after the creation */
+CollisionMesh *createCollisionMesh(Mesh *meshes, int meshCount);
+
+/* Returns the collision mesh of the triangles of 'meshes' from the cache of the world, it is
+ * created the first time and shared by every call with the same triangles after that, like
+ * the bodies of the many copies of a model. Release it with freeCollisionMesh */
+CollisionMesh *acquireCollisionMesh(Mesh *meshes, int meshCount);
+
+/* Drops a reference to the collision mesh 'cm' and frees it when it was the last one */
+void freeCollisionMesh(CollisionMesh *cm);
+
+/* Frees the rigid body identified by 'h' and removes it from the world in constant time */
+void freeRigidBody(BodyHandle h);
+
+/* Merges the triangles of the RIGID_FIXED bodies made from meshes in the broadphase in a single
+ * body, with one BVH in world space, and takes them out of the broadphase. The baked bodies stay
+ * valid but their collision meshes are freed and moving them doesn't move their triangles
+ * anymore. The triangles are read from the meshes the bodies were made from, which must still
+ * be loaded. If 'cachePath' is not NULL the merged mesh is read from that file when it was
+ * written for the same meshes and positions, otherwise it is built and written there. With the
+ * cache the bodies whose collision mesh was deferred never build it. It returns 1 if the cache
+ * was used, 0 otherwise */
+int bakeStaticWorld(const char *cachePath);
 
 /* Updates the rigid body position and computes the new box vertices world position */
 void updateRigidBodyPosition(RigidBody *r, Vector3 pos);
 
+/* =============== Broadphase Functions =============== */
+
+/* Inserts the rigid body 'r' in the broadphase cells covered by its box */
+void broadphaseInsert(RigidBody *r);
+
+/* Removes the rigid body 'r' from the broadphase cells it was hashed into */
+void broadphaseRemove(RigidBody *r);
+
+/* Moves the rigid body 'r' to the cells covered by its box, it does nothing if
+ * the body did not leave its cells */
+void broadphaseUpdate(RigidBody *r);
+
+/* Fills the world pair list with the candidate pairs whose boxes overlap, each pair
+ * has a RIGID body as 'a' and it is reported only once. PHANTOM bodies are not paired,
+ * the RIGID bodies overlapping them go to the trigger overlaps of the step instead */
+void broadphaseFindPairs(void);
+
 /* =============== Check Collision Functions =============== */
 
 /* Checks for a collision between the two bodies 'a' and 'b' using AABB. It returns 0 if there are no
@@ -100,12 +546,35 @@ void updateRigidBodyPosition(RigidBody *r, Vector3 pos);
 CollisionInfo checkCollisionAABB(RigidBody *a, RigidBody *b);
 
 /* Checks for collision between two rigid bodies 'a' and 'b', checking for the type of 
- * object and using the corresponding collision funciton */
+ * object and using the corresponding collision funciton. The bodies are not modified, the
+ * ground distance of 'a' measured against 'b' is returned in the info */
 CollisionInfo checkCollision(RigidBody *a, RigidBody *b);
 
-/* Checks for collision between a box 'b' and a complex shape 'm' using SAT */
+/* Checks for collision between two boxes 'a' and 'b' from their bounds only, the ground
+ * distance of 'a' measured against 'b' is returned in the info */
+CollisionInfo collisionBoxAndBox(RigidBody *a, RigidBody *b);
+
+/* Checks for collision between a box 'b' and a complex shape 'm' using SAT, the ground
+ * distance of 'a' measured against 'b' is returned in the info */
 CollisionInfo collisionSATBoxAndComplexShape(RigidBody *a, RigidBody *b);
 
+/* Tests the box 'b' against 'count' (at most SAT_LANES) triangles of 'cm' starting from 'first'
+ * on the 13 SAT axes, box and triangles must be in the same space. It returns a mask where bit i
+ * is set if the triangle 'first' + i overlaps the box and stores in 'faceLength[i]' its overlap
+ * length on the triangle normal. 'faceLength' must hold SAT_LANES floats. If 'earlyOuts' is not
+ * NULL the separated triangles are counted in it by the axis that separated them, like in
+ * PhysicsStats.satEarlyOuts. This is the SSE2/AVX2 kernel when available and the scalar one otherwise */
+int satBoxTriangles(Box *b, CollisionMesh *cm, int first, int count, float *faceLength, int *earlyOuts);
+
+/* Scalar version of satBoxTriangles, both versions give the same results */
+int satBoxTrianglesScalar(Box *b, CollisionMesh *cm, int first, int count, float *faceLength, int *earlyOuts);
+
+/* Sweeps the box of 'r' by 'displacement' against the walls of the RIGID_FIXED meshes and returns
+ * the fraction of the displacement, from 0 to 1, at which the box first touches one of them,
+ * or 1 if it touches none. The normal of the wall is stored in 'normal'. Walls that already
+ * overlap the box at the start are ignored, they are left to the narrowphase */
+float sweepRigidBody(RigidBody *r, Vector3 displacement, Vector3 *normal);
+
 /* Checks if a box 'bf' overlaps the triangle 'v1', 'v2', 'v3' on axis n using
  * the dot product (axis projection) and return the length of ther intersection */
 float checkOverlappingBoxAndTriangleOnAxis(Box *b, Vector3 v1, Vector3 v2, Vector3 v3, Vector3 n);
@@ -114,6 +583,23 @@ float checkOverlappingBoxAndTriangleOnAxis(Box *b, Vector3 v1, Vector3 v2, Vecto
  * using the dot product (axis projection) and return the length of ther intersection */
 float checkOverlappingBoxBaseAndTriangleOnAxis(Box *b, Vector3 v1, Vector3 v2, Vector3 v3, Vector3 n);
 
+/* =============== Query Functions =============== */
+
+/* Answers the 'count' queries of 'queries' in 'results', they are spread on the physics threads.
+ * The baked static world answers as a single body. The world must not change meanwhile */
+void runPhysicsQueries(PhysicsQuery *queries, QueryResult *results, int count);
+
+/* Casts a ray from 'origin' along 'direction' up to 'distance' against the RIGID and RIGID_FIXED
+ * bodies, it returns 1 if it hit something and stores the nearest hit in 'hit' (can be NULL) */
+int raycast(Vector3 origin, Vector3 direction, float distance, QueryResult *hit);
+
+/* Returns the number of RIGID and RIGID_FIXED bodies overlapping the box of center 'center' and
+ * half size 'halfSize' and stores up to 'max' of them in 'bodies' (can be NULL) */
+int overlapBox(Vector3 center, Vector3 halfSize, BodyHandle *bodies, int max);
+
+/* Like overlapBox for the sphere of center 'center' and radius 'radius' */
+int overlapSphere(Vector3 center, float radius, BodyHandle *bodies, int max);
+
 /* =============== Collision Resolution Functions =============== */
 
 /* Handles the collision between the two bodies 'a' and 'b' using 'i' as info
@@ -122,8 +608,78 @@ void handleCollision(RigidBody *a, RigidBody *b, CollisionInfo i, float frameTim
 
 /* =============== State Update Functions =============== */
 
+/* Steps the world, the narrowphase runs on the physics threads */
 void updateWorld(float frameTime);
 
+/* Wakes up 'r' if it is sleeping, its island wakes up with it on the next update */
+void wakeRigidBody(RigidBody *r);
+
+/* Advances the world by 'frameTime'. In fixed timestep mode the time is accumulated and the world
+ * is updated in steps of fixed duration, at most 'maxSubsteps' per call, otherwise the world is
+ * updated once with 'frameTime'. It returns the number of steps run */
+int stepWorld(float frameTime);
+
+/* Enables the fixed timestep mode with steps of 'step' seconds and at most 'maxSubsteps' steps
+ * per frame, a 'step' of 0 disables it */
+void setFixedTimestep(float step, int maxSubsteps);
+
+/* Returns how far the simulation time is between the last step and the next one, from 0 to 1 */
+float getStepAlpha(void);
+
+/* Returns the position of 'r' interpolated between the last two steps, to render it smoothly
+ * when the frame rate differs from the simulation rate */
+Vector3 getInterpolatedPosition(RigidBody *r);
+
+/* Returns the trigger events of the steps run by the last call to stepWorld or updateWorld and
+ * stores their number in 'count', meant to be called after them each frame: the events of a call
+ * are dropped by the next one, drained or not. PHANTOM bodies are not resolved against the other
+ * bodies, each step records an enter, stay or exit event for every RIGID body whose box starts,
+ * keeps or stops overlapping theirs. Sleeping bodies keep the overlaps they had when they fell
+ * asleep. The events stay valid until the next call to stepWorld or updateWorld */
+TriggerEvent *drainTriggerEvents(int *count);
+
+/* Sets the number of threads running the narrowphase, the calling thread included. The
+ * results do not depend on the number of threads */
+void setPhysicsThreads(int count);
+
+/* Returns the counters of the last world update */
+PhysicsStats getPhysicsStats(void);
+
+/* Copies the stats of the last 'max' steps at most into 'steps', from the oldest,
+ * and returns how many were copied */
+int getPhysicsTrace(PhysicsStats *steps, int max);
+
+/* Writes the stats of the steps in the trace to 'f' as CSV, one line per step, times are in microseconds */
+void writePhysicsTraceCSV(FILE *f);
+
+/* Writes the stats of the steps in the trace to 'f' as a JSON array, times are in microseconds */
+void writePhysicsTraceJSON(FILE *f);
+
+/* =============== Recording Functions =============== */
+
+/* Starts recording the world to 'path': the bodies as they are now, then the duration of every
+ * frame run with updateWorld or stepWorld and the velocities the game gave to the bodies before
+ * it. Bodies must not be created or freed while recording. It returns 0 if the file can't be
+ * written */
+int startPhysicsRecording(const char *path);
+
+/* Ends the recording with the checksum of the world, replays compare theirs with it */
+void stopPhysicsRecording(void);
+
+/* Opens the recording at 'path' and loads the world it started from, the world must be empty.
+ * The recording must come from a build with the same SAT lanes. It returns NULL if the file is
+ * not a valid recording */
+PhysicsReplay *openPhysicsReplay(const char *path);
+
+/* Replays the next frame of 'replay' and returns the number of steps it ran, -1 once the recording
+ * is over */
+int replayPhysicsFrame(PhysicsReplay *replay);
+
+void closePhysicsReplay(PhysicsReplay *replay);
+
+/* Hash of the position, velocity and state of every body, equal between runs that did the same */
+unsigned long long getWorldChecksum(void);
+
 /* =============== Vector Utility Functions =============== */
 
 /* Calculates the Vector product between 'v1' and 'v2' */
@@ -0,0 +1,499 @@
+#include "props.h"
+#include "utils.h"
+#include "raylib/src/rlgl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <float.h>
+
+#define INSTANCES_INITIAL_CAPACITY 64
+
+static DrawStats stats;
+
+/* ============= Culling Functions =============  */
+
+Frustum getFrustum(void) {
+	// clip = P * V * p, the planes come from the sums and differences of the rows of P * V
+	Matrix m = MatrixMultiply(MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview()), rlGetMatrixProjection());
+	Vector4 rows[4] = {
+		{ m.m0, m.m4, m.m8,  m.m12 },
+		{ m.m1, m.m5, m.m9,  m.m13 },
+		{ m.m2, m.m6, m.m10, m.m14 },
+		{ m.m3, m.m7, m.m11, m.m15 }
+	};
+	Frustum f;
+	for(int i = 0; i < 3; i++) {
+		Vector4 r = rows[i], w = rows[3];
+		f.planes[i * 2    ] = (Vector4) { w.x + r.x, w.y + r.y, w.z + r.z, w.w + r.w };
+		f.planes[i * 2 + 1] = (Vector4) { w.x - r.x, w.y - r.y, w.z - r.z, w.w - r.w };
+	}
+	return f;
+}
+
+/* Returns true if 'box' is at least in part inside 'f'. The box is out when its corner farthest
+ * along the normal of a plane is behind it */
+static bool boxInFrustum(Frustum *f, BoundingBox box) {
+	for(int i = 0; i < 6; i++) {
+		Vector4 p = f->planes[i];
+		float x = p.x >= 0 ? box.max.x : box.min.x;
+		float y = p.y >= 0 ? box.max.y : box.min.y;
+		float z = p.z >= 0 ? box.max.z : box.min.z;
+		if(p.x * x + p.y * y + p.z * z + p.w < 0) return false;
+	}
+	return true;
+}
+
+bool cullBox(Frustum *f, BoundingBox box) {
+	bool visible = boxInFrustum(f, box);
+	if(visible) stats.visibleObjects++;
+	else stats.culledObjects++;
+	return visible;
+}
+
+DrawStats getDrawStats(void) {
+	return stats;
+}
+
+void resetDrawStats(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+static BoundingBox emptyBox(void) {
+	return (BoundingBox) { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+}
+
+static BoundingBox mergeBoxes(BoundingBox a, BoundingBox b) {
+	return (BoundingBox) { Vector3Min(a.min, b.min), Vector3Max(a.max, b.max) };
+}
+
+/* Returns the chunk of 'index' holding the center of 'box', -1 if it's out of the chunks */
+static int chunkOf(CullIndex *index, BoundingBox box) {
+	int x = (int)floorf(((box.min.x + box.max.x) / 2 - index->originX) / CULL_CHUNK_SIZE);
+	int z = (int)floorf(((box.min.z + box.max.z) / 2 - index->originZ) / CULL_CHUNK_SIZE);
+	if(x < 0 || x >= index->cols || z < 0 || z >= index->rows) return -1;
+	return x + z * index->cols;
+}
+
+/* ============= Instance Buffer Functions =============  */
+
+static void initInstanceBuffer(InstanceBuffer *ib, int stride) {
+	ib->stride = stride;
+	ib->capacity = INSTANCES_INITIAL_CAPACITY;
+	ib->data = xmalloc(stride * ib->capacity);
+	ib->slots = xmalloc(sizeof(*ib->slots) * ib->capacity);
+	ib->chunks = xmalloc(sizeof(*ib->chunks) * ib->capacity);
+	ib->boxes = xmalloc(sizeof(*ib->boxes) * ib->capacity);
+	ib->count = 0;
+	ib->slotCount = 0;
+	ib->reorder = false;
+	memset(&ib->index, 0, sizeof(ib->index));
+	ib->vboId = 0;
+	ib->vboCapacity = 0;
+	ib->dirtyMin = INT_MAX;
+	ib->dirtyMax = -1;
+}
+
+static void markDirty(InstanceBuffer *ib, int slot) {
+	if(slot < ib->dirtyMin) ib->dirtyMin = slot;
+	if(slot > ib->dirtyMax) ib->dirtyMax = slot;
+}
+
+/* New instances take the slot after the last one used, they are sorted with the others when
+ * the buffer is uploaded */
+static int addInstance(InstanceBuffer *ib, const void *instance, BoundingBox box) {
+	if(ib->slotCount == ib->capacity) {
+		ib->capacity *= 2;
+		ib->data = xrealloc(ib->data, ib->stride * ib->capacity);
+		ib->slots = xrealloc(ib->slots, sizeof(*ib->slots) * ib->capacity);
+		ib->chunks = xrealloc(ib->chunks, sizeof(*ib->chunks) * ib->capacity);
+		ib->boxes = xrealloc(ib->boxes, sizeof(*ib->boxes) * ib->capacity);
+	}
+	int i = ib->count++;
+	ib->slots[i] = ib->slotCount++;
+	ib->boxes[i] = box;
+	memcpy(ib->data + ib->slots[i] * ib->stride, instance, ib->stride);
+	ib->reorder = true;
+	return i;
+}
+
+/* Returns the instance at index 'i', now in 'box', and marks it to be uploaded, the caller
+ * changes it. If it left its chunk the instances are sorted again */
+static void *editInstance(InstanceBuffer *ib, int i, BoundingBox box) {
+	if(i < 0 || i >= ib->count) {
+		fprintf(stderr, "ERROR instance %d is not in the batch\n", i);
+		exit(1);
+	}
+	ib->boxes[i] = box;
+	if(!ib->reorder) {
+		int chunk = chunkOf(&ib->index, box);
+		if(chunk == ib->chunks[i]) {
+			ib->index.chunkBoxes[chunk] = mergeBoxes(ib->index.chunkBoxes[chunk], box);
+			markDirty(ib, ib->slots[i]);
+		}
+		else ib->reorder = true;
+	}
+	return ib->data + ib->slots[i] * ib->stride;
+}
+
+/* The last instance takes index 'i' and the slot of the removed one, its own slot stays unused
+ * until the instances are sorted again */
+static void removeInstance(InstanceBuffer *ib, int i) {
+	if(i < 0 || i >= ib->count) {
+		fprintf(stderr, "ERROR instance %d is not in the batch\n", i);
+		exit(1);
+	}
+	int last = --ib->count;
+	if(i != last) {
+		memcpy(ib->data + ib->slots[i] * ib->stride, ib->data + ib->slots[last] * ib->stride, ib->stride);
+		ib->boxes[i] = ib->boxes[last];
+	}
+	ib->reorder = true;
+}
+
+/* Builds the index again and sorts the slots by chunk, with a counting sort. The chunks cover
+ * the centers of the boxes of all the instances */
+static void sortInstances(InstanceBuffer *ib) {
+	CullIndex *index = &ib->index;
+	float minX = FLT_MAX, minZ = FLT_MAX, maxX = -FLT_MAX, maxZ = -FLT_MAX;
+	for(int i = 0; i < ib->count; i++) {
+		float x = (ib->boxes[i].min.x + ib->boxes[i].max.x) / 2;
+		float z = (ib->boxes[i].min.z + ib->boxes[i].max.z) / 2;
+		if(x < minX) minX = x;
+		if(x > maxX) maxX = x;
+		if(z < minZ) minZ = z;
+		if(z > maxZ) maxZ = z;
+	}
+	index->originX = minX;
+	index->originZ = minZ;
+	index->cols = (int)((maxX - minX) / CULL_CHUNK_SIZE) + 1;
+	index->rows = (int)((maxZ - minZ) / CULL_CHUNK_SIZE) + 1;
+	int chunkCount = index->cols * index->rows;
+	if(chunkCount > index->chunkCapacity) {
+		index->chunkCapacity = chunkCount;
+		index->chunkStart = xrealloc(index->chunkStart, sizeof(*index->chunkStart) * (chunkCount + 1));
+		index->chunkBoxes = xrealloc(index->chunkBoxes, sizeof(*index->chunkBoxes) * chunkCount);
+		index->runs = xrealloc(index->runs, sizeof(*index->runs) * 2 * chunkCount);
+	}
+
+	memset(index->chunkStart, 0, sizeof(*index->chunkStart) * (chunkCount + 1));
+	for(int c = 0; c < chunkCount; c++) index->chunkBoxes[c] = emptyBox();
+	for(int i = 0; i < ib->count; i++) {
+		int chunk = chunkOf(index, ib->boxes[i]);
+		ib->chunks[i] = chunk;
+		index->chunkStart[chunk + 1]++;
+		index->chunkBoxes[chunk] = mergeBoxes(index->chunkBoxes[chunk], ib->boxes[i]);
+	}
+	for(int c = 0; c < chunkCount; c++) index->chunkStart[c + 1] += index->chunkStart[c];
+
+	// the runs are free until the draw, they count the slots already given to each chunk
+	int *next = index->runs;
+	memcpy(next, index->chunkStart, sizeof(*next) * chunkCount);
+	unsigned char *sorted = xmalloc(ib->stride * ib->capacity);
+	for(int i = 0; i < ib->count; i++) {
+		int slot = next[ib->chunks[i]]++;
+		memcpy(sorted + slot * ib->stride, ib->data + ib->slots[i] * ib->stride, ib->stride);
+		ib->slots[i] = slot;
+	}
+	free(ib->data);
+	ib->data = sorted;
+	ib->slotCount = ib->count;
+	ib->reorder = false;
+}
+
+/* Uploads the slots changed since the last upload, all of them when they were sorted again.
+ * The GPU buffer is created again when they don't fit anymore */
+static void uploadInstances(InstanceBuffer *ib) {
+	if(ib->reorder) {
+		sortInstances(ib);
+		markDirty(ib, 0);
+		markDirty(ib, ib->count - 1);
+	}
+	if(ib->count > ib->vboCapacity) {
+		if(ib->vboId) rlUnloadVertexBuffer(ib->vboId);
+		ib->vboCapacity = ib->capacity;
+		ib->vboId = rlLoadVertexBuffer(NULL, ib->vboCapacity * ib->stride, true);
+		rlUpdateVertexBuffer(ib->vboId, ib->data, ib->count * ib->stride, 0);
+	}
+	else if(ib->dirtyMin <= ib->dirtyMax) {
+		int count = ib->dirtyMax - ib->dirtyMin + 1;
+		rlUpdateVertexBuffer(ib->vboId, ib->data + ib->dirtyMin * ib->stride, count * ib->stride, ib->dirtyMin * ib->stride);
+	}
+	ib->dirtyMin = INT_MAX;
+	ib->dirtyMax = -1;
+}
+
+/* Culls the chunks of 'ib' against 'f' and returns the number of runs of slots to draw, the
+ * first slot and the count of run r are in 'index.runs[r * 2]' and 'index.runs[r * 2 + 1]'.
+ * The chunks next to each other in the slots are merged in a single run */
+static int visibleRuns(InstanceBuffer *ib, Frustum *f) {
+	CullIndex *index = &ib->index;
+	int runCount = 0;
+	for(int c = 0; c < index->cols * index->rows; c++) {
+		int first = index->chunkStart[c];
+		int count = index->chunkStart[c + 1] - first;
+		if(count == 0) continue;
+		if(!boxInFrustum(f, index->chunkBoxes[c])) {
+			stats.culledChunks++;
+			stats.culledObjects += count;
+			continue;
+		}
+		stats.visibleChunks++;
+		stats.visibleObjects += count;
+		if(runCount > 0 && index->runs[runCount * 2 - 2] + index->runs[runCount * 2 - 1] == first) {
+			index->runs[runCount * 2 - 1] += count;
+		} else {
+			index->runs[runCount * 2] = first;
+			index->runs[runCount * 2 + 1] = count;
+			runCount++;
+		}
+	}
+	return runCount;
+}
+
+static void freeInstanceBuffer(InstanceBuffer *ib) {
+	if(ib->vboId) rlUnloadVertexBuffer(ib->vboId);
+	free(ib->data);
+	free(ib->slots);
+	free(ib->chunks);
+	free(ib->boxes);
+	free(ib->index.chunkStart);
+	free(ib->index.chunkBoxes);
+	free(ib->index.runs);
+}
+
+/* Points the attribute at 'loc' of the vertex array currently enabled to 'components' floats at
+ * 'offset' in each instance of 'ib', from the slot 'first'. GL 3.3 has no base instance, so the
+ * attributes are moved to the first slot of each run before drawing it */
+static void setInstanceAttribute(InstanceBuffer *ib, int loc, int components, int offset, int first) {
+	rlEnableVertexAttribute(loc);
+	rlSetVertexAttribute(loc, components, RL_FLOAT, false, ib->stride, first * ib->stride + offset);
+	rlSetVertexAttributeDivisor(loc, 1);
+}
+
+/* Returns the location of the attribute 'name' of 'shader', it fails if the shader doesn't have it */
+static int getInstanceAttribute(Shader shader, const char *name) {
+	int loc = GetShaderLocationAttrib(shader, name);
+	if(loc < 0) {
+		fprintf(stderr, "ERROR the instanced shader has no %s attribute\n", name);
+		exit(1);
+	}
+	return loc;
+}
+
+/* ============= Prop Functions =============  */
+
+/* Points the transform attribute of 'mesh' to the transforms from the slot 'first', a mat4
+ * attribute takes four consecutive locations, one for each column */
+static void attachTransforms(PropBatch *b, Mesh mesh, int first) {
+	rlEnableVertexArray(mesh.vaoId);
+	rlEnableVertexBuffer(b->instances.vboId);
+	for(int i = 0; i < 4; i++) setInstanceAttribute(&b->instances, b->transformLoc + i, 4, i * sizeof(Vector4), first);
+	rlDisableVertexBuffer();
+}
+
+/* Returns the box around the model of 'b' moved by 'transform' */
+static BoundingBox transformedModelBox(PropBatch *b, Matrix transform) {
+	BoundingBox box = emptyBox();
+	for(int i = 0; i < 8; i++) {
+		Vector3 corner = {
+			i & 1 ? b->modelBox.max.x : b->modelBox.min.x,
+			i & 2 ? b->modelBox.max.y : b->modelBox.min.y,
+			i & 4 ? b->modelBox.max.z : b->modelBox.min.z
+		};
+		corner = Vector3Transform(corner, transform);
+		box.min = Vector3Min(box.min, corner);
+		box.max = Vector3Max(box.max, corner);
+	}
+	return box;
+}
+
+PropBatch *createPropBatch(Model model, Shader shader) {
+	if(model.meshCount == 0 || model.meshes[0].vertices == NULL) {
+		fprintf(stderr, "ERROR the prop model has no vertices to get its bounding box\n");
+		exit(1);
+	}
+	PropBatch *b = xmalloc(sizeof(*b));
+	b->model = model;
+	b->modelBox = GetModelBoundingBox(model);
+	b->shader = shader;
+	b->transformLoc = getInstanceAttribute(shader, PROP_TRANSFORM_ATTRIB);
+	initInstanceBuffer(&b->instances, sizeof(float16));
+	return b;
+}
+
+int addProp(PropBatch *b, Matrix transform) {
+	float16 t = MatrixToFloatV(transform);
+	return addInstance(&b->instances, &t, transformedModelBox(b, transform));
+}
+
+void setPropTransform(PropBatch *b, int i, Matrix transform) {
+	*(float16 *)editInstance(&b->instances, i, transformedModelBox(b, transform)) = MatrixToFloatV(transform);
+}
+
+void removeProp(PropBatch *b, int i) {
+	removeInstance(&b->instances, i);
+}
+
+/* Like DrawMeshInstanced, but the transforms are already on the GPU and only the diffuse map
+ * is bound, the props have no other maps */
+void drawPropBatch(PropBatch *b, Frustum *f) {
+	if(b->instances.count == 0) return;
+	uploadInstances(&b->instances);
+	int runCount = visibleRuns(&b->instances, f);
+	if(runCount == 0) return;
+
+	// the model matrix of each copy is applied by the shader, mvp is only view and projection
+	Matrix viewProjection = MatrixMultiply(MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview()), rlGetMatrixProjection());
+	int *locs = b->shader.locs;
+	int *runs = b->instances.index.runs;
+	for(int m = 0; m < b->model.meshCount; m++) {
+		Mesh mesh = b->model.meshes[m];
+		Material material = b->model.materials[b->model.meshMaterial[m]];
+
+		rlEnableShader(b->shader.id);
+		if(locs[SHADER_LOC_COLOR_DIFFUSE] != -1) {
+			Color c = material.maps[MATERIAL_MAP_DIFFUSE].color;
+			float color[4] = { c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, c.a / 255.0f };
+			rlSetUniform(locs[SHADER_LOC_COLOR_DIFFUSE], color, RL_SHADER_UNIFORM_VEC4, 1);
+		}
+		rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], viewProjection);
+
+		int slot = 0;
+		rlActiveTextureSlot(slot);
+		rlEnableTexture(material.maps[MATERIAL_MAP_DIFFUSE].texture.id);
+		rlSetUniform(locs[SHADER_LOC_MAP_DIFFUSE], &slot, RL_SHADER_UNIFORM_INT, 1);
+
+		for(int r = 0; r < runCount; r++) {
+			attachTransforms(b, mesh, runs[r * 2]);
+			if(mesh.indices != NULL) rlDrawVertexElementsInstanced(0, mesh.triangleCount * 3, 0, runs[r * 2 + 1]);
+			else rlDrawVertexArrayInstanced(0, mesh.vertexCount, runs[r * 2 + 1]);
+		}
+
+		rlActiveTextureSlot(slot);
+		rlDisableTexture();
+		rlDisableVertexArray();
+		rlDisableShader();
+	}
+}
+
+void freePropBatch(PropBatch *b) {
+	if(b == NULL) {
+		fprintf(stderr, "ERROR trying to free an invalid pointer\n");
+		exit(1);
+	}
+	freeInstanceBuffer(&b->instances);
+	free(b);
+}
+
+/* ============= Billboard Functions =============  */
+
+/* Points the instanced attributes of the quad vertex array to the billboards from the slot 'first' */
+static void attachBillboards(BillboardBatch *b, int first) {
+	rlEnableVertexArray(b->vaoId);
+	rlEnableVertexBuffer(b->instances.vboId);
+	setInstanceAttribute(&b->instances, b->positionLoc, 3, offsetof(BillboardInstance, position), first);
+	setInstanceAttribute(&b->instances, b->sizeLoc, 2, offsetof(BillboardInstance, size), first);
+	setInstanceAttribute(&b->instances, b->rectLoc, 4, offsetof(BillboardInstance, rect), first);
+	rlDisableVertexBuffer();
+}
+
+/* The quad turns around the up axis, so it stays in a box as wide as it is along x and z */
+static BoundingBox billboardBox(Vector3 position, Vector2 size) {
+	Vector3 half = { size.x / 2, size.y / 2, size.x / 2 };
+	return (BoundingBox) { Vector3Subtract(position, half), Vector3Add(position, half) };
+}
+
+BillboardBatch *createBillboardBatch(Texture2D texture, Shader shader) {
+	BillboardBatch *b = xmalloc(sizeof(*b));
+	b->texture = texture;
+	b->shader = shader;
+	b->positionLoc = getInstanceAttribute(shader, BILLBOARD_POSITION_ATTRIB);
+	b->sizeLoc = getInstanceAttribute(shader, BILLBOARD_SIZE_ATTRIB);
+	b->rectLoc = getInstanceAttribute(shader, BILLBOARD_RECT_ATTRIB);
+	initInstanceBuffer(&b->instances, sizeof(BillboardInstance));
+
+	// the two triangles of the quad, the corners go from -0.5 to 0.5 and y goes up
+	float corners[12] = {
+		-0.5f, -0.5f,   0.5f, -0.5f,   0.5f, 0.5f,
+		-0.5f, -0.5f,   0.5f,  0.5f,  -0.5f, 0.5f
+	};
+	b->vaoId = rlLoadVertexArray();
+	rlEnableVertexArray(b->vaoId);
+	b->quadVboId = rlLoadVertexBuffer(corners, sizeof(corners), false);
+	rlEnableVertexAttribute(shader.locs[SHADER_LOC_VERTEX_POSITION]);
+	rlSetVertexAttribute(shader.locs[SHADER_LOC_VERTEX_POSITION], 2, RL_FLOAT, false, 0, 0);
+	rlDisableVertexBuffer();
+	rlDisableVertexArray();
+	return b;
+}
+
+int addBillboard(BillboardBatch *b, Vector3 position, Vector2 size, Rectangle source) {
+	BillboardInstance instance = {
+		.position = position,
+		.size = size,
+		.rect = (Vector4) {
+			source.x / b->texture.width,
+			source.y / b->texture.height,
+			(source.x + source.width) / b->texture.width,
+			(source.y + source.height) / b->texture.height
+		}
+	};
+	return addInstance(&b->instances, &instance, billboardBox(position, size));
+}
+
+void setBillboardPosition(BillboardBatch *b, int i, Vector3 position) {
+	if(i < 0 || i >= b->instances.count) {
+		fprintf(stderr, "ERROR billboard %d is not in the batch\n", i);
+		exit(1);
+	}
+	BillboardInstance *instance = (BillboardInstance *)(b->instances.data + b->instances.slots[i] * b->instances.stride);
+	instance = editInstance(&b->instances, i, billboardBox(position, instance->size));
+	instance->position = position;
+}
+
+void removeBillboard(BillboardBatch *b, int i) {
+	removeInstance(&b->instances, i);
+}
+
+void drawBillboardBatch(BillboardBatch *b, Frustum *f) {
+	if(b->instances.count == 0) return;
+	uploadInstances(&b->instances);
+	int runCount = visibleRuns(&b->instances, f);
+	if(runCount == 0) return;
+
+	// the shader takes the right vector of the camera from the view matrix
+	Matrix view = MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview());
+	int *locs = b->shader.locs;
+	rlEnableShader(b->shader.id);
+	rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(view, rlGetMatrixProjection()));
+	rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_VIEW], view);
+
+	int slot = 0;
+	rlActiveTextureSlot(slot);
+	rlEnableTexture(b->texture.id);
+	rlSetUniform(locs[SHADER_LOC_MAP_DIFFUSE], &slot, RL_SHADER_UNIFORM_INT, 1);
+
+	int *runs = b->instances.index.runs;
+	for(int r = 0; r < runCount; r++) {
+		attachBillboards(b, runs[r * 2]);
+		rlDrawVertexArrayInstanced(0, 6, runs[r * 2 + 1]);
+	}
+
+	rlActiveTextureSlot(slot);
+	rlDisableTexture();
+	rlDisableVertexArray();
+	rlDisableShader();
+}
+
+void freeBillboardBatch(BillboardBatch *b) {
+	if(b == NULL) {
+		fprintf(stderr, "ERROR trying to free an invalid pointer\n");
+		exit(1);
+	}
+	freeInstanceBuffer(&b->instances);
+	rlUnloadVertexBuffer(b->quadVboId);
+	rlUnloadVertexArray(b->vaoId);
+	free(b);
+}
@@ -0,0 +1,159 @@
+#ifndef PROPS_H
+#define PROPS_H
+
+#include "raylib/src/raylib.h"
+#include "raylib/src/raymath.h"
+
+/* Name of the per instance model matrix in the vertex shaders used to draw the props */
+#define PROP_TRANSFORM_ATTRIB "instanceTransform"
+
+/* Names of the per instance attributes in the vertex shaders used to draw the billboards */
+#define BILLBOARD_POSITION_ATTRIB "instancePosition"
+#define BILLBOARD_SIZE_ATTRIB "instanceSize"
+#define BILLBOARD_RECT_ATTRIB "instanceRect"
+
+/* Side of the square chunks of the XZ plane the instances of a batch are grouped in to be culled */
+#define CULL_CHUNK_SIZE 4.0f
+
+/* The planes of a view frustum, a point p is inside when dot(plane.xyz, p) + plane.w >= 0
+ * for all of them */
+typedef struct Frustum {
+	Vector4 planes[6];
+} Frustum;
+
+/* Counts of the objects and the chunks of instances drawn and culled since the last
+ * resetDrawStats, for profiling */
+typedef struct DrawStats {
+	int visibleObjects;
+	int culledObjects;
+	int visibleChunks;
+	int culledChunks;
+} DrawStats;
+
+/* Spatial index of the instances of a batch. The instances are sorted by the chunk holding the
+ * center of their box, the instances of chunk c go from 'chunkStart[c]' to 'chunkStart[c + 1]'
+ * and 'chunkBoxes[c]' holds all their boxes. The chunks cover the boxes centers from 'originX',
+ * 'originZ', row by row. 'runs' has room for the ranges of instances drawn in a frame */
+typedef struct CullIndex {
+	float originX;
+	float originZ;
+	int cols;
+	int rows;
+	int *chunkStart;
+	BoundingBox *chunkBoxes;
+	int *runs;
+	int chunkCapacity;
+} CullIndex;
+
+/* The per instance data of a batch, 'count' elements of 'stride' bytes stored as the GPU reads
+ * them. The instance i is at the slot 'slots[i]' of 'data', the slots are sorted by chunk when the
+ * index is built again ('reorder'), which happens when instances are added or removed or move to
+ * another chunk. 'chunks' and 'boxes' are the chunk and the bounding box of each instance.
+ * The slots are kept in a GPU buffer where only the ones changed since the last upload are sent
+ * again, 'dirtyMin' and 'dirtyMax' are the range to upload, it's empty when 'dirtyMin' > 'dirtyMax' */
+typedef struct InstanceBuffer {
+	unsigned char *data;
+	int stride;
+	int count;
+	int slotCount;
+	int capacity;
+	int *slots;
+	int *chunks;
+	BoundingBox *boxes;
+	bool reorder;
+	CullIndex index;
+	unsigned int vboId;
+	int vboCapacity;
+	int dirtyMin;
+	int dirtyMax;
+} InstanceBuffer;
+
+/* A PropBatch draws the copies of a model with an instanced draw per mesh for each run of
+ * visible chunks. The transforms of the copies live in a GPU buffer shared by the meshes of the
+ * model, it's attached to the vertex arrays of the meshes, so a model must belong to a single
+ * batch. 'modelBox' is the bounding box of the model, moved by the transform of each copy */
+typedef struct PropBatch {
+	Model model;
+	BoundingBox modelBox;
+	Shader shader;
+	int transformLoc;
+	InstanceBuffer instances;
+} PropBatch;
+
+/* A billboard as stored in the GPU buffer of a BillboardBatch, 'rect' is the part of the texture
+ * drawn as u0, v0, u1, v1 */
+typedef struct BillboardInstance {
+	Vector3 position;
+	Vector2 size;
+	Vector4 rect;
+} BillboardInstance;
+
+/* A BillboardBatch draws its billboards with an instanced draw of a quad for each run of
+ * visible chunks. The quads are turned to the camera by the vertex shader, around the up axis
+ * like DrawBillboardPro with up (0, 1, 0), so the CPU does nothing for the billboards that
+ * don't change */
+typedef struct BillboardBatch {
+	Texture2D texture;
+	Shader shader;
+	unsigned int vaoId;
+	unsigned int quadVboId;
+	int positionLoc;
+	int sizeLoc;
+	int rectLoc;
+	InstanceBuffer instances;
+} BillboardBatch;
+
+/* Returns the frustum of the current 3D mode, it has to be called between BeginMode3D and EndMode3D */
+Frustum getFrustum(void);
+
+/* Returns true if 'box' is at least in part inside the frustum 'f', it's counted in the draw stats */
+bool cullBox(Frustum *f, BoundingBox box);
+
+DrawStats getDrawStats(void);
+
+/* Sets the draw stats to zero, it's called at the beginning of each frame */
+void resetDrawStats(void);
+
+/* Creates a batch of copies of 'model' drawn with 'shader', which must take the model matrix
+ * from the PROP_TRANSFORM_ATTRIB attribute. The batch doesn't own the model, which must still
+ * have its vertices to get its bounding box */
+PropBatch *createPropBatch(Model model, Shader shader);
+
+/* Adds a copy of the model placed by 'transform', returns its index in the batch */
+int addProp(PropBatch *b, Matrix transform);
+
+/* Moves the copy at index 'i' */
+void setPropTransform(PropBatch *b, int i, Matrix transform);
+
+/* Removes the copy at index 'i', the last copy takes its index */
+void removeProp(PropBatch *b, int i);
+
+/* Draws the copies in the chunks inside the frustum 'f', it has to be called between
+ * BeginMode3D and EndMode3D */
+void drawPropBatch(PropBatch *b, Frustum *f);
+
+/* Frees the memory pointed by 'b' and its GPU buffer */
+void freePropBatch(PropBatch *b);
+
+/* Creates a batch of billboards showing parts of 'texture', drawn with 'shader' which must take
+ * the BILLBOARD_*_ATTRIB attributes. The batch doesn't own the texture */
+BillboardBatch *createBillboardBatch(Texture2D texture, Shader shader);
+
+/* Adds a billboard of 'size' centered on 'position' showing the 'source' part of the texture,
+ * returns its index in the batch */
+int addBillboard(BillboardBatch *b, Vector3 position, Vector2 size, Rectangle source);
+
+/* Moves the billboard at index 'i' */
+void setBillboardPosition(BillboardBatch *b, int i, Vector3 position);
+
+/* Removes the billboard at index 'i', the last billboard takes its index */
+void removeBillboard(BillboardBatch *b, int i);
+
+/* Draws the billboards in the chunks inside the frustum 'f', it has to be called between
+ * BeginMode3D and EndMode3D */
+void drawBillboardBatch(BillboardBatch *b, Frustum *f);
+
+/* Frees the memory pointed by 'b' and its GPU buffers */
+void freeBillboardBatch(BillboardBatch *b);
+
+#endif
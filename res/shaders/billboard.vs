@@ -0,0 +1,35 @@
+#version 330
+
+// Input vertex attributes, the corner of the quad from (-0.5, -0.5) to (0.5, 0.5)
+in vec2 vertexPosition;
+// billboard center, size and part of the texture as u0, v0, u1, v1
+in vec3 instancePosition;
+in vec2 instanceSize;
+in vec4 instanceRect;
+
+// Input uniform values, mvp is only view and projection
+uniform mat4 mvp;
+uniform mat4 matView;
+
+// Output vertex attributes (to fragment shader)
+out vec3 fragPosition;
+out vec2 fragTexCoord;
+out vec4 fragColor;
+out vec3 fragNormal;
+
+void main()
+{
+    // the quad turns around the up axis to face the camera, like DrawBillboardPro with up (0, 1, 0)
+    vec3 right = vec3(matView[0][0], matView[1][0], matView[2][0]);
+    vec3 up = vec3(0.0, 1.0, 0.0);
+    vec3 position = instancePosition + right*(vertexPosition.x*instanceSize.x) + up*(vertexPosition.y*instanceSize.y);
+
+    // Send vertex attributes to fragment shader, the top of the quad is the top of the texture part
+    fragPosition = position;
+    fragTexCoord = mix(instanceRect.xy, instanceRect.zw, vec2(vertexPosition.x + 0.5, 0.5 - vertexPosition.y));
+    fragColor = vec4(1.0);
+    fragNormal = normalize(cross(right, up));
+
+    // Calculate final vertex position
+    gl_Position = mvp*vec4(position, 1.0);
+}
@@ -0,0 +1,32 @@
+#version 330
+
+// Input vertex attributes
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec3 vertexNormal;
+in vec4 vertexColor;
+// model matrix of the instance, it takes the place of matModel
+in mat4 instanceTransform;
+
+// Input uniform values
+uniform mat4 mvp;
+
+// Output vertex attributes (to fragment shader)
+out vec3 fragPosition;
+out vec2 fragTexCoord;
+out vec4 fragColor;
+out vec3 fragNormal;
+
+void main()
+{
+    // Send vertex attributes to fragment shader
+    vec4 worldPosition = instanceTransform*vec4(vertexPosition, 1.0);
+    fragPosition = vec3(worldPosition);
+    fragTexCoord = vertexTexCoord;
+    fragColor = vertexColor;
+    // the props are only moved, rotated and scaled uniformly, the model matrix works for the normals too
+    fragNormal = normalize(mat3(instanceTransform)*vertexNormal);
+
+    // Calculate final vertex position, mvp is only view and projection
+    gl_Position = mvp*worldPosition;
+}
@@ -0,0 +1,68 @@
+#include "shaders.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Name, type and number of floats of each ShaderUniform */
+static const struct {
+	const char *name;
+	int type;
+	int size;
+} uniforms[UNIFORM_COUNT] = {
+	[UNIFORM_TIME]              = { "time",            SHADER_UNIFORM_FLOAT, 1 },
+	[UNIFORM_LIGHT_COLOR]       = { "lightColor",      SHADER_UNIFORM_VEC3,  3 },
+	[UNIFORM_AMBIENT]           = { "ambient",         SHADER_UNIFORM_VEC3,  3 },
+	[UNIFORM_LOCAL_LIGHT]       = { "localLight",      SHADER_UNIFORM_VEC3,  3 },
+	[UNIFORM_LOCAL_LIGHT_COLOR] = { "localLightColor", SHADER_UNIFORM_VEC3,  3 },
+	[UNIFORM_RESOLUTION]        = { "resolution",      SHADER_UNIFORM_VEC2,  2 }
+};
+
+static ShaderProgram programs[MAX_SHADER_PROGRAMS];
+static int programCount = 0;
+static int uploads = 0;
+
+ShaderProgram *loadShaderProgram(const char *vsPath, const char *fsPath) {
+	if(programCount == MAX_SHADER_PROGRAMS) {
+		fprintf(stderr, "ERROR the shader registry is full, %s can't be loaded\n", fsPath);
+		exit(1);
+	}
+	ShaderProgram *p = &programs[programCount++];
+	p->shader = LoadShader(vsPath, fsPath);
+	for(int u = 0; u < UNIFORM_COUNT; u++) {
+		p->locs[u] = GetShaderLocation(p->shader, uniforms[u].name);
+		p->uploaded[u] = false;
+	}
+	return p;
+}
+
+void setShaderUniform(ShaderProgram *p, ShaderUniform u, const void *value) {
+	if(p->locs[u] < 0) return;
+	size_t size = sizeof(float) * uniforms[u].size;
+	if(p->uploaded[u] && memcmp(p->values[u], value, size) == 0) return;
+	memcpy(p->values[u], value, size);
+	p->uploaded[u] = true;
+	SetShaderValue(p->shader, p->locs[u], value, uniforms[u].type);
+	uploads++;
+}
+
+void setFrameConstants(FrameConstants *c) {
+	for(int i = 0; i < programCount; i++) {
+		ShaderProgram *p = &programs[i];
+		setShaderUniform(p, UNIFORM_TIME, &c->time);
+		setShaderUniform(p, UNIFORM_LIGHT_COLOR, &c->lightColor);
+		setShaderUniform(p, UNIFORM_AMBIENT, &c->ambient);
+		setShaderUniform(p, UNIFORM_LOCAL_LIGHT, &c->localLight);
+		setShaderUniform(p, UNIFORM_LOCAL_LIGHT_COLOR, &c->localLightColor);
+	}
+}
+
+int getShaderUploads(void) {
+	int count = uploads;
+	uploads = 0;
+	return count;
+}
+
+void unloadShaderPrograms(void) {
+	for(int i = 0; i < programCount; i++) UnloadShader(programs[i].shader);
+	programCount = 0;
+}
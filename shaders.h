@@ -0,0 +1,55 @@
+#ifndef SHADERS_H
+#define SHADERS_H
+
+#include "raylib/src/raylib.h"
+
+#define MAX_SHADER_PROGRAMS 16
+
+/* The uniforms known by the registry, their locations are resolved once when a program is
+ * loaded. The ones from UNIFORM_TIME to UNIFORM_LOCAL_LIGHT_COLOR are the frame constants */
+typedef enum {
+	UNIFORM_TIME,
+	UNIFORM_LIGHT_COLOR,
+	UNIFORM_AMBIENT,
+	UNIFORM_LOCAL_LIGHT,
+	UNIFORM_LOCAL_LIGHT_COLOR,
+	UNIFORM_RESOLUTION,
+	UNIFORM_COUNT
+} ShaderUniform;
+
+/* The uniforms shared by all the programs, they are set once per frame with setFrameConstants */
+typedef struct FrameConstants {
+	float time;
+	Vector3 lightColor;
+	Vector3 ambient;
+	Vector3 localLight;
+	Vector3 localLightColor;
+} FrameConstants;
+
+/* A shader loaded through the registry. 'locs' are the locations of the uniforms, -1 for the ones
+ * the shader doesn't have, and 'values' the values last uploaded, when 'uploaded' is set */
+typedef struct ShaderProgram {
+	Shader shader;
+	int locs[UNIFORM_COUNT];
+	float values[UNIFORM_COUNT][4];
+	bool uploaded[UNIFORM_COUNT];
+} ShaderProgram;
+
+/* Loads the shader made of the files at 'vsPath' and 'fsPath' and adds it to the registry,
+ * which owns it */
+ShaderProgram *loadShaderProgram(const char *vsPath, const char *fsPath);
+
+/* Sets the uniform 'u' of 'p' to 'value', it's uploaded only if it changed since the last time */
+void setShaderUniform(ShaderProgram *p, ShaderUniform u, const void *value);
+
+/* Sets the frame constants of all the programs of the registry, each program gets only the
+ * values that changed since the last frame */
+void setFrameConstants(FrameConstants *c);
+
+/* Returns the number of uniform values uploaded since the last call, for profiling */
+int getShaderUploads(void);
+
+/* Unloads all the programs of the registry */
+void unloadShaderPrograms(void);
+
+#endif